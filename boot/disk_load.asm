@@ -1,15 +1,13 @@
 ; INT 13h AH=02h
-; load DH sectors to ES:BX from drive DL sector AL
+; load DH sectors to ES:BX from drive DL cylinder CH head AH sector AL
 disk_load:
     push dx          ; Store DX on stack so later we can recall
                      ; how many sectors were request to be read,
                      ; even if it is altered  in the meantime
-    mov cl, al       ; Start reading from second sector (i.e.
-                     ; after the boot sector)
-    mov ah, 0x02     ; BIOS read sector function
+    mov cl, al       ; Start reading from sector AL
     mov al, dh       ; Read DH sectors
-    mov ch, 0x00     ; Select cylinder 0
-    mov dh, 0x00     ; Select head 0
+    mov dh, ah       ; Select head AH
+    mov ah, 0x02     ; BIOS read sector function
     int 0x13         ; BIOS interrupt
 
     jc disk_error    ; Jump if error (i.e. carry flag set)
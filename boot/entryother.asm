@@ -0,0 +1,69 @@
+; Application processors (APs) start here, in real mode, when the boot
+; processor sends them a STARTUP IPI with the address of this code, see
+; lapic_startap(). The kernel copies it to AP_ENTRY (0x7000), a page
+; aligned address below 1MiB, and embeds it as a binary blob.
+;
+; Just as the boot loader does for the boot processor, we switch to protected
+; mode and then turn on paging with entrypgdir, as kernel_entry.asm does.
+; The kernel leaves the arguments in the words right below our code:
+;   start-4:  top of this cpu's kernel stack
+;   start-8:  C function to call, mpenter()
+;   start-12: physical address of entrypgdir
+;
+; From xv6 entryother.S.
+
+%include "kernel/paging_defs.asm"
+
+[bits 16]
+[org 0x7000]
+
+start:
+    cli                         ; Interrupts stay off until scheduler()
+
+    xor ax, ax                  ; Zero data segment registers DS, ES, and SS
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    lgdt [gdt_descriptor]       ; Boot GDT: flat code and data segments
+
+    mov eax, cr0
+    or eax, CR0_PE
+    mov cr0, eax
+
+    jmp CODE_SEG:start32        ; Reload CS, flushes the prefetched real-mode
+                                ; instructions
+
+[bits 32]
+start32:
+    mov ax, DATA_SEG
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax                  ; Zero the segments not ready for use
+    mov fs, ax
+    mov gs, ax
+
+    ; Turn on page size extension for 4Mbyte pages
+    mov eax, cr4
+    or eax, CR4_PSE
+    mov cr4, eax
+
+    ; Use entrypgdir as our initial page table
+    mov eax, [start - 12]
+    mov cr3, eax
+
+    ; Turn on paging.
+    mov eax, cr0
+    or eax, CR0_PG|CR0_WP
+    mov cr0, eax
+
+    ; Switch to the stack allocated by startothers()
+    mov esp, [start - 4]
+
+    ; Call mpenter()
+    call [start - 8]
+
+    jmp $                       ; mpenter() doesn't return
+
+%include "gdt.asm"
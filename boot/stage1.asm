@@ -49,7 +49,8 @@ load_stage2:
     mov dh, STAGE2_SECTORS
     nop
     nop
-    mov al, 0x02     ; Start reading from sector BL.
+    xor ch, ch       ; Cylinder 0
+    mov ax, 0x0002   ; Head 0, start reading from sector 2.
     mov dl, [BOOT_DRIVE]
     call disk_load
 
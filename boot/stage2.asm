@@ -5,6 +5,24 @@ KERNEL_OFFSET1 equ 0x20000      ; Memory offset to which we will temporarily
                                 ; load our kernel.
 KERNEL_OFFSET2 equ 0x100000     ; Final memory offset for the kernel.
 
+; Floppy geometry (1.44MB), to convert the LBA of kernel sectors to the CHS
+; format expected by INT 13h: cylinder << 16 | head << 8 | sector.
+SECTORS_PER_TRACK equ 18
+HEADS             equ 2
+%define LBA2CHS(lba) ((((lba) / (SECTORS_PER_TRACK * HEADS)) << 16) | \
+                      ((((lba) / SECTORS_PER_TRACK) % HEADS) << 8) | \
+                      (((lba) % SECTORS_PER_TRACK) + 1))
+
+KERNEL_LBA      equ 1 + STAGE2_SECTORS  ; Kernel follows stage1 and stage2.
+%if KERNEL_SECTORS > 64
+KERNEL_SECTORS1 equ 64
+%else
+KERNEL_SECTORS1 equ KERNEL_SECTORS
+%endif
+KERNEL_SECTORS2 equ KERNEL_SECTORS - KERNEL_SECTORS1
+KERNEL_CHS1     equ LBA2CHS(KERNEL_LBA)
+KERNEL_CHS2     equ LBA2CHS(KERNEL_LBA + KERNEL_SECTORS1)
+
 global MEM_MAP:
 MEM_MAP        equ 0xA000       ; Memory map. The number of entries will be
                                 ; stored at the beginning.
@@ -50,7 +68,7 @@ start16:
     ; There's also a bit of a catch-22 as we can't know for sure if 1MB is
     ; usable until getting the memory map from e820: there can be memory hole
     ; or defect anywhere. The load/copy call would then fail.
-    mov cx, (512 * KERNEL_SECTORS)
+    mov cx, (512 * KERNEL_SECTORS) / 2  ; Number of words
     call copy_extmem    ; Copy kernel to high memory
 
     mov bx, MSG_KERNEL_COPIED
@@ -88,10 +106,25 @@ load_kernel:
     mov es, bx
     mov bx, KERNEL_OFFSET1 & 0xffff
 
-    mov dh, KERNEL_SECTORS
-    mov al, 1 + STAGE2_SECTORS + 1    ; Start reading from sector BL.
+    ; A single read can't cross a 64KiB boundary, nor can it exceed 72
+    ; sectors with bochs. So we read the kernel in two halves.
+    mov dh, KERNEL_SECTORS1
+    mov ch, KERNEL_CHS1 >> 16
+    mov ax, KERNEL_CHS1 & 0xffff
+    mov dl, [BOOT_DRIVE]
+    call disk_load
+
+%if KERNEL_SECTORS2 > 0
+    mov bx, (KERNEL_OFFSET1 + 512 * KERNEL_SECTORS1) >> 4
+    mov es, bx
+    xor bx, bx
+
+    mov dh, KERNEL_SECTORS2
+    mov ch, KERNEL_CHS2 >> 16
+    mov ax, KERNEL_CHS2 & 0xffff
     mov dl, [BOOT_DRIVE]
     call disk_load
+%endif
 
     pop es
     ret
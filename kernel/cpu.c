@@ -1,6 +1,5 @@
+#include "drivers/lapic.h"
 #include "drivers/screen.h"
-#include "spinlock.h"
-#include "lib/debug.h"
 
 #include "cpu.h"
 
@@ -8,21 +7,17 @@ struct cpu cpus[MAX_CPUS];
 int ncpu;
 uint8_t ioapicid;
 
-// Must be called with interrupts disabled to avoid the caller being
-// rescheduled between reading lapicid and running through the loop.
-struct cpu*
-mycpu(void)
-{
-  if(readeflags()&FL_IF)
-    panic("mycpu called with interrupts enabled\n");
-
-  return &cpus[0];
-}
-
-
+/**
+ * Give each cpu listed by ACPI its slot. The boot processor keeps cpus[0],
+ * which holds its state since boot. Must follow lapic_init().
+ */
 void cpu_init() {
     cprintf("CPUS: %d\n", acpi_info.num_cpus);
+    uint8_t bsp = lapic_id();
+    cpus[0].apicid = bsp;
+    ncpu = 1;
     for (int i = 0; i < acpi_info.num_cpus; ++i) {
-        cpus[i].apicid = acpi_info.cpu[i].apic;
+        if (acpi_info.cpu[i].apic != bsp)
+            cpus[ncpu++].apicid = acpi_info.cpu[i].apic;
     }
 }
@@ -1,8 +1,14 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include "drivers/acpi.h"
+#include "drivers/screen.h"
 #include "gdt.h"
+#include "kalloc.h"
+#include "paging.h"
+#include "spinlock.h"
 
 // Task state segment format
 struct taskstate {
@@ -45,18 +51,37 @@ struct taskstate {
   uint16_t  iomb;               // I/O map base address
 };
 
+// Processes ready to run on a cpu, in order. See proc.c.
+struct runqueue {
+  struct spinlock lock;
+  struct process *head;        // Next to run
+  struct process *tail;
+  volatile uint32_t len;       // Read without the lock to pick a victim
+};
+
 // Per-CPU state
 struct cpu {
   uint8_t apicid;              // Local APIC ID
   struct context *scheduler;   // swtch() here to enter scheduler
   struct taskstate ts;         // Used by x86 to find stack for interrupt
   struct segdesc gdt[NSEGS];   // x86 global descriptor table
-  /* volatile bool started;       // Has the CPU started? */
+  volatile uint32_t started;   // Has the CPU started?
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
+  pde_t *pgdir;                // Page directory currently loaded in CR3
+  volatile bool pgdir_stale;   // Its page tables changed from another cpu
+  volatile uint32_t tlb_gen;   // Last tlb_shootdown() caught up with
+  struct frame_cache fcache;   // Free frames for kalloc()/kfree()
+  struct runqueue rq;          // RUNNABLE processes for this cpu
+
+  // Cpu-local storage variables, at %gs:0 and %gs:4, see gdt_init().
+  struct cpu *cpu;             // This very struct
   struct process *proc;        // The process running on this cpu or null
 };
 
+_Static_assert(offsetof(struct cpu, proc) == offsetof(struct cpu, cpu) + 4,
+               "%gs:4 must be cpu.proc");
+
 extern struct cpu cpus[MAX_CPUS];
 extern int ncpu;
 
@@ -97,7 +122,60 @@ struct segdesc {
 
   (uint)(lim) >> @28@, 0, 0, 1, @1@, (uint)(base) >> 24 }
 */
-struct cpu* mycpu(void);
+
+/**
+ * The current cpu: a single load through its %gs segment. A process moved to
+ * another cpu uses that cpu's %gs, which isn't part of its context. The
+ * answer may still be outdated as soon as interrupts are enabled.
+ */
+static inline struct cpu *
+mycpu(void)
+{
+  struct cpu *c;
+  __asm__ __volatile__("movl %%gs:0, %0" : "=r" (c));
+  return c;
+}
+
+/** The current process, or null in the scheduler. */
+static inline struct process *
+myproc(void)
+{
+  struct process *p;
+  __asm__ __volatile__("movl %%gs:4, %0" : "=r" (p));
+  return p;
+}
+
+// Pushcli/popcli are like cli/sti except that they are matched:
+// it takes two popcli to undo two pushcli.  Also, if interrupts
+// are off, then pushcli, popcli leaves them off.
+
+static inline void
+pushcli(void)
+{
+  uint32_t eflags = readeflags();
+  cli();
+  struct cpu *c = mycpu();
+  if(c->ncli++ == 0)
+    c->intena = eflags & FL_IF;
+}
+
+static inline void
+popcli(void)
+{
+  struct cpu *c = mycpu();
+  if(--c->ncli < 0)
+    panic("popcli");
+  if(c->ncli == 0 && c->intena)
+    sti();
+}
+
+// Check whether this cpu is holding the lock. No need to disable interrupts:
+// if we hold it, they are already.
+static inline int
+holding(struct spinlock *lock)
+{
+  return lock->locked && lock->cpu == mycpu();
+}
 
 void cpu_init();
 
@@ -108,6 +108,7 @@ static void parse_madt(struct madt *madt, uint32_t len)
   uintptr_t end = (uintptr_t)madt + len;
   struct madt_entry *e = (void *)madt->data;
   cprintf("Local Interrupt Controller: 0x%x\n", madt->lic_address);
+  acpi_info.lapic = madt->lic_address;
   while((uintptr_t)e < end)
   {
     if (e->len == 0) // guard rail since bochs reports strange entries…
@@ -118,7 +119,7 @@ static void parse_madt(struct madt *madt, uint32_t len)
     {
       case MADT_CPU: // APIC descriptor (corresponds to unique cpu core)
         // Check if cpu is enabled
-        if(!(e->lapic.id & 1)) break;
+        if(!(e->lapic.flags & 1) || acpi_info.num_cpus == MAX_CPUS) break;
         // Add to list
         i = acpi_info.num_cpus;
         acpi_info.cpu[i].id = e->lapic.id;
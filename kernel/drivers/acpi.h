@@ -11,6 +11,8 @@ extern uintptr_t acpi;
 extern uint32_t  acpi_len;
 
 struct acpi_info {
+  uint32_t lapic;  // local APIC address, the same for every cpu
+
   int num_cpus;
 
   struct {
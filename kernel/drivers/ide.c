@@ -2,6 +2,7 @@
 #include "lib/string.h"
 #include "idt.h"
 #include "low_level.h"
+#include "slab.h"
 #include "spinlock.h"
 
 #include "drivers/ide.h"
@@ -113,11 +114,15 @@ void ide_init(void) {
     model[39] = 0; // Terminate String.
     cprintf("ide_init: found ATA drive model: %s\n", model);
 
-    struct block_req b = {0};
-    strncpy(b.data, "FOUDIL WAS HERE", 20);
-    b.flags = BLOCK_DIRTY;
-    b.dev = 1;
-    ide_start(&b);
+    struct block_req *b = kmalloc(sizeof(*b));
+    if (!b)
+        error("ide_init: kmalloc");
+    memset(b, 0, sizeof(*b));
+    strncpy(b->data, "FOUDIL WAS HERE", 20);
+    b->flags = BLOCK_DIRTY;
+    b->dev = 1;
+    ide_rw(b);
+    kmfree(b);
 }
 
 static void
@@ -125,11 +130,13 @@ ide_start(struct block_req *b)
 {
   if(b == 0)
     panic("ide_start");
-  if(b->block_no >= FSSIZE)
+  if(b->block_no >= DISKSIZE)
     panic("incorrect blockno");
   int32_t sector = b->block_no * SECTORS_PER_BLOCK;
-  int32_t read_cmd  = (SECTORS_PER_BLOCK == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int32_t write_cmd = (SECTORS_PER_BLOCK == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  // Not the *MUL variants: they need SET MULTIPLE MODE first, which we never
+  // issue (hence the bochs complaint below).
+  int32_t read_cmd  = IDE_CMD_READ;
+  int32_t write_cmd = IDE_CMD_WRITE;
 
   if (SECTORS_PER_BLOCK > 7) panic("ide_start");
 
@@ -140,15 +147,57 @@ ide_start(struct block_req *b)
   outb(IDE_LBA_MI, (sector >> 8) & 0xff);
   outb(IDE_LBA_HI, (sector >> 16) & 0xff);
   outb(IDE_SELECT, LBA_SELECT(b->dev, sector));
-  if(b->flags & BLOCK_DIRTY){
-    outb(IDE_COMMAND, write_cmd);
+  // The data, if any, is exchanged sector by sector by ide_rw().
+  outb(IDE_COMMAND, (b->flags & BLOCK_DIRTY) ? write_cmd : read_cmd);
+}
+
+/**
+ * Wait for the drive to be done with the current command, or to be ready for
+ * the next sector of data (DRQ), either way. Returns false on errors or
+ * device faults.
+ */
+static bool
+ide_wait(bool drq)
+{
+    uint8_t status;
+    do {
+        status = inb(IDE_STATUS);
+        if ((status & (IDE_STATUS_DF | IDE_STATUS_ERR)) != 0)
+            return false;
+    } while ((status & IDE_STATUS_BSY) || (drq && !(status & IDE_STATUS_DRQ)));
+    return true;
+}
+
+/**
+ * Synchronously read block b, or write it if BLOCK_DIRTY, polling the drive
+ * instead of waiting for its interrupt. Returns false on disk errors.
+ */
+bool
+ide_rw(struct block_req *b)
+{
+    bool ok = true;
+
+    acquire(&ide_lock);
+    ide_start(b);
     /** Must be a stream in 32-bit dwords, can't be in 8-bit bytes. */
-    // FIXME bochs ">>PANIC<< IO write(0x01f0): current command is 00h". Not
-    // sure why the command (controller->current_command) is not 0xc5 at this
-    // point. Works well with IDE_CMD_WRITE.
-    outsl(IDE_DATA, b->data, BLOCK_SIZE / sizeof(uint32_t));
-    /* outb(IDE_COMMAND, IDE_CMD_FLUSH); */
-  } else {
-    outb(IDE_COMMAND, read_cmd);
-  }
+    for (int i = 0; ok && i < SECTORS_PER_BLOCK; i++) {
+        if (!(ok = ide_wait(true)))
+            break;
+        if (b->flags & BLOCK_DIRTY)
+            outsl(IDE_DATA, b->data + i * IDE_SECTOR_SIZE,
+                  IDE_SECTOR_SIZE / sizeof(uint32_t));
+        else
+            insl(IDE_DATA, b->data + i * IDE_SECTOR_SIZE,
+                 IDE_SECTOR_SIZE / sizeof(uint32_t));
+    }
+    // Writes are only done once the drive has taken the last sector.
+    if (ok && (b->flags & BLOCK_DIRTY))
+        ok = ide_wait(false);
+    if (ok) {
+        b->flags |= BLOCK_VALID;
+        b->flags &= ~BLOCK_DIRTY;
+    }
+    release(&ide_lock);
+
+    return ok;
 }
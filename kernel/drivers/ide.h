@@ -70,7 +70,11 @@
 #define ATA_IDENT_COMMANDSETS  82
 #define ATA_IDENT_MAX_LBA_EXT  100
 
+/** Drives on the primary bus. */
+#define IDE_NDEV 2
+
 void ide_init();
+bool ide_rw(struct block_req *b);
 
 
 #endif
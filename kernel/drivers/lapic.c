@@ -0,0 +1,174 @@
+// The local APIC manages internal (non-I/O) interrupts.
+// See Chapter 8 & Appendix C of Intel processor manual volume 3.
+// From xv6 lapic.c.
+
+#include <stdbool.h>
+#include "drivers/acpi.h"
+#include "idt.h"
+#include "low_level.h"
+#include "paging.h"
+
+#include "drivers/lapic.h"
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID      (0x0020/4)   // ID
+#define VER     (0x0030/4)   // Version
+#define TPR     (0x0080/4)   // Task Priority
+#define EOI     (0x00B0/4)   // EOI
+#define SVR     (0x00F0/4)   // Spurious Interrupt Vector
+  #define ENABLE     0x00000100   // Unit Enable
+#define ESR     (0x0280/4)   // Error Status
+#define ICRLO   (0x0300/4)   // Interrupt Command
+  #define FIXED      0x00000000
+  #define INIT       0x00000500   // INIT/RESET
+  #define STARTUP    0x00000600   // Startup IPI
+  #define DELIVS     0x00001000   // Delivery status
+  #define ASSERT     0x00004000   // Assert interrupt (vs deassert)
+  #define DEASSERT   0x00000000
+  #define LEVEL      0x00008000   // Level triggered
+  #define BCAST      0x00080000   // Send to all APICs, including self.
+  #define OTHERS     0x000C0000   // Send to all APICs, excluding self.
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+#define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
+#define PCINT   (0x0340/4)   // Performance Counter LVT
+#define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
+#define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
+#define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
+  #define EXTINT     0x00000700   // Delivered as from the 8259 PIC
+  #define NMI        0x00000400
+  #define MASKED     0x00010000   // Interrupt masked
+
+#define CMOS_PORT    0x70
+#define CMOS_RETURN  0x71
+
+volatile uint32_t *lapic;  // Initialized by the boot processor's lapic_init()
+
+static void
+lapicw(int index, uint32_t value)
+{
+  lapic[index] = value;
+  lapic[ID];  // wait for write to finish, by reading
+}
+
+static void spurious_handler(struct interrupt_state *state) {
+    (void) state;   /** Unused. Spurious interrupts are not acknowledged. */
+}
+
+/**
+ * Enable this cpu's local APIC. The boot processor keeps receiving the PIC's
+ * interrupts through LINT0, as in the virtual wire mode the BIOS left us
+ * in; application processors only get IPIs.
+ */
+void
+lapic_init(void)
+{
+  bool bsp = rdmsr(MSR_APIC_BASE) & MSR_APIC_BASE_BSP;
+
+  if(bsp){
+    lapic = (volatile uint32_t*)(acpi_info.lapic ? acpi_info.lapic :
+                                 (uint32_t)rdmsr(MSR_APIC_BASE) & ~0xFFF);
+    isr_register(IDT_LAPIC_SPURIOUS, &spurious_handler);
+  }
+
+  // Enable local APIC; set spurious interrupt vector.
+  lapicw(SVR, ENABLE | IDT_LAPIC_SPURIOUS);
+
+  // No timer: the PIT ticks on the boot processor.
+  lapicw(TIMER, MASKED);
+
+  lapicw(LINT0, bsp ? EXTINT : MASKED);
+  lapicw(LINT1, NMI);
+
+  // Disable performance counter overflow interrupts
+  // on machines that provide that interrupt entry.
+  if(((lapic[VER]>>16) & 0xFF) >= 4)
+    lapicw(PCINT, MASKED);
+
+  lapicw(ERROR, MASKED);
+
+  // Clear error status register (requires back-to-back writes).
+  lapicw(ESR, 0);
+  lapicw(ESR, 0);
+
+  // Ack any outstanding interrupts.
+  lapicw(EOI, 0);
+
+  // Send an Init Level De-Assert to synchronise arbitration ID's.
+  lapicw(ICRHI, 0);
+  lapicw(ICRLO, BCAST | INIT | LEVEL);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+
+  // Enable interrupts on the APIC (but not on the processor).
+  lapicw(TPR, 0);
+}
+
+/** APIC ID of this cpu, 0 until the local APIC is known. */
+uint8_t
+lapic_id(void)
+{
+  if(!lapic)
+    return 0;
+  return lapic[ID] >> 24;
+}
+
+// Acknowledge interrupt.
+void
+lapic_eoi(void)
+{
+  if(lapic)
+    lapicw(EOI, 0);
+}
+
+// Spin for a given number of microseconds: a write to the POST diagnostic
+// port goes over the ISA bus, which takes about one.
+void
+microdelay(int us)
+{
+  while(us-- > 0)
+    outb(0x80, 0);
+}
+
+// Start additional processor running entry code at addr.
+// See Appendix B of MultiProcessor Specification.
+void
+lapic_startap(uint8_t apicid, uint32_t addr)
+{
+  // "The BSP must initialize CMOS shutdown code to 0AH
+  // and the warm reset vector (DWORD based at 40:67) to point at
+  // the AP startup code prior to the [universal startup algorithm]."
+  outb(CMOS_PORT, 0xF);  // offset 0xF is shutdown code
+  outb(CMOS_PORT+1, 0x0A);
+  uint16_t *wrv = (uint16_t*)P2V((0x40<<4 | 0x67));  // Warm reset vector
+  wrv[0] = 0;
+  wrv[1] = addr >> 4;
+
+  // "Universal startup algorithm."
+  // Send INIT (level-triggered) interrupt to reset other CPU.
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, INIT | LEVEL | ASSERT);
+  microdelay(200);
+  lapicw(ICRLO, INIT | LEVEL);
+  microdelay(100);    // should be 10ms, but too slow in Bochs!
+
+  // Send startup IPI (twice!) to enter code.
+  // Regular hardware is supposed to only accept a STARTUP
+  // when it is in the halted state due to an INIT.  So the second
+  // should be ignored, but it is part of the official Intel algorithm.
+  // Bochs complains about the second one.  Too bad for Bochs.
+  for(int i = 0; i < 2; i++){
+    lapicw(ICRHI, apicid<<24);
+    lapicw(ICRLO, STARTUP | (addr>>12));
+    microdelay(200);
+  }
+}
+
+/** Send interrupt vector to all cpus but this one. */
+void
+lapic_ipi_others(uint8_t vector)
+{
+  lapicw(ICRHI, 0);
+  lapicw(ICRLO, OTHERS | FIXED | ASSERT | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
@@ -0,0 +1,25 @@
+/**
+ * Local APIC, one per cpu: identifies the cpu, receives its interrupts and
+ * sends inter-processor interrupts (IPIs). Device interrupts still come from
+ * the PIC, through the boot processor's LINT0 pin.
+ */
+#ifndef LAPIC_H
+#define LAPIC_H
+
+
+#include <stdint.h>
+
+/** Where boot/entryother is copied for application processors to start. */
+#define AP_ENTRY 0x7000
+
+extern volatile uint32_t *lapic;
+
+void lapic_init(void);
+uint8_t lapic_id(void);
+void lapic_eoi(void);
+void lapic_startap(uint8_t apicid, uint32_t addr);
+void lapic_ipi_others(uint8_t vector);
+void microdelay(int us);
+
+
+#endif /* LAPIC_H */
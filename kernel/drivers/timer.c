@@ -23,6 +23,11 @@ static void timer_interrupt_handler(struct interrupt_state *state) {
 }
 
 
+/** Timer interrupts since boot. */
+uint64_t timer_ticks(void) {
+    return ticks;
+}
+
 /**
  * Initialize the PIT timer. Registers timer interrupt ISR handler, sets
  * PIT to run in mode 3 with given frequency in Hz.
@@ -1,12 +1,15 @@
 #ifndef TIMER_H
 #define TIMER_H
 
+#include <stdint.h>
+
 
 #define TIMER_FREQ_BASE_HZ 1193182
 /** Timer interrupt frequency in Hz. */
 #define TIMER_FREQ_HZ      100
 
 void timer_init();
+uint64_t timer_ticks(void);
 
 
 #endif /* TIMER_H */
@@ -1,6 +1,7 @@
 // Intel 8250 serial port (UART).
 
 #include "drivers/ioapic.h"
+#include "drivers/lapic.h"
 #include "drivers/screen.h"
 #include "idt.h"
 #include "low_level.h"
@@ -11,11 +12,6 @@
 
 static int uart;    // is there a uart?
 
-// xv6 lapic.c
-// Spin for a given number of microseconds.
-// On real hardware would want to tune this dynamically.
-void microdelay(int us) { }
-
 void
 uartputc(uint8_t c)
 {
@@ -0,0 +1,51 @@
+/**
+ * ELF32 executable format, as much as needed to load user programs. From
+ * xv6.
+ */
+#ifndef ELF_H
+#define ELF_H
+
+#include <stdint.h>
+
+#define ELF_MAGIC 0x464C457FU  // "\x7FELF" in little endian
+
+/** File header. */
+struct elfhdr {
+  uint32_t magic;  // must equal ELF_MAGIC
+  uint8_t  elf[12];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  uint32_t entry;
+  uint32_t phoff;
+  uint32_t shoff;
+  uint32_t flags;
+  uint16_t ehsize;
+  uint16_t phentsize;
+  uint16_t phnum;
+  uint16_t shentsize;
+  uint16_t shnum;
+  uint16_t shstrndx;
+};
+
+/** Program section header. */
+struct proghdr {
+  uint32_t type;
+  uint32_t off;
+  uint32_t vaddr;
+  uint32_t paddr;
+  uint32_t filesz;
+  uint32_t memsz;
+  uint32_t flags;
+  uint32_t align;
+};
+
+/** Values for proghdr type. */
+#define ELF_PROG_LOAD           1
+
+/** Flag bits for proghdr flags. */
+#define ELF_PROG_FLAG_EXEC      1
+#define ELF_PROG_FLAG_WRITE     2
+#define ELF_PROG_FLAG_READ      4
+
+#endif /* ELF_H */
@@ -14,6 +14,8 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define SWAPSIZE     4096  // size of the swap area in blocks, after the fs
+#define DISKSIZE     (FSSIZE + SWAPSIZE)
 
 #define BLOCK_VALID 1<<1  // buffer has been read from disk
 #define BLOCK_DIRTY 1<<2  // buffer needs to be written to disk
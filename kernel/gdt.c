@@ -34,17 +34,59 @@ gdt_set_entry(struct segdesc *seg, uint32_t base, uint32_t limit,
 }
 
 
-void gdt_init(void) {
-    isr_register(IDT_INT_GPFLT, &protection_fault_handler);
+static inline void gdt_load_task_reg(uint16_t sel)
+{
+    __asm__ __volatile__ ( "ltr %0" : : "r" (sel) );
+}
+
+/**
+ * Install this cpu's task state segment. This is done once: switching
+ * processes then only updates the kernel stack pointer ts.esp0.
+ */
+static void tss_init(struct cpu *c) {
+    gdt_set_entry(&c->gdt[SEG_TSS],
+                  /* base */ (uint32_t)&c->ts,
+                  /* limit */ sizeof(c->ts)-1,
+                  /* access */ SEG_PRESENT|SEG_RING0|SEG_TSS32_AVAIL, // 0x89 0b10001001
+                  /* flags */ 0); // 16-bit segment
+    // SS0 and ESP0 are used by software interrupts.
+    //
+    // Reminder(see gdt_load.asm): selector in segmentation consists of
+    // [15-3: idx, 2: table indicator, 1-0: requested privilege level].
+    c->ts.ss0 = SEG_KDATA << 3;
+    // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
+    // forbids I/O instructions (e.g., inb and outb) from user space
+    c->ts.iomb = (uint16_t) 0xFFFF;
+    gdt_load_task_reg(SEG_TSS << 3);
+}
+
+static inline void gdt_load_gs(uint16_t sel)
+{
+    __asm__ __volatile__ ( "movw %0, %%gs" : : "r" (sel) );
+}
+
+/**
+ * Load cpu c's own GDT and TSS, and point %gs at c for mycpu() and myproc().
+ * Called by every cpu as it starts, the boot processor first, before
+ * anything uses mycpu().
+ */
+void gdt_init(struct cpu *c) {
+    if (c == &cpus[0])
+        isr_register(IDT_INT_GPFLT, &protection_fault_handler);
 
-    struct cpu *c = &cpus[0]; //cpuid()]; FIXME when we do smp
     gdt_set_entry(&c->gdt[SEG_KCODE], 0, 0xffffffff, SEG_APP|SEG_CODE|SEG_RING0|SEG_RW|SEG_PRESENT, SEG_32BIT|SEG_4K);
     gdt_set_entry(&c->gdt[SEG_KDATA], 0, 0xffffffff, SEG_APP|SEG_RING0|SEG_RW|SEG_PRESENT, SEG_32BIT|SEG_4K);
     gdt_set_entry(&c->gdt[SEG_UCODE], 0, 0xffffffff, SEG_APP|SEG_CODE|SEG_RING3|SEG_RW|SEG_PRESENT, SEG_32BIT|SEG_4K);
     gdt_set_entry(&c->gdt[SEG_UDATA], 0, 0xffffffff, SEG_APP|SEG_RING3|SEG_RW|SEG_PRESENT, SEG_32BIT|SEG_4K);
+    // Map cpu-local storage variables: c->cpu at %gs:0, c->proc at %gs:4.
+    gdt_set_entry(&c->gdt[SEG_KCPU], (uint32_t)&c->cpu, 8 - 1, SEG_APP|SEG_RING0|SEG_RW|SEG_PRESENT, SEG_32BIT);
 
     /* __asm__ __volatile__("xchg %bx, %bx"); // Bochs magic break */
 
     struct gdtr gdtr = {.limit = sizeof(c->gdt), .base = (uint32_t)&c->gdt};
     gdt_load(&gdtr);
+    gdt_load_gs(SEG_KCPU << 3);
+    c->cpu = c;
+
+    tss_init(c);
 }
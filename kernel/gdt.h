@@ -9,6 +9,7 @@
 #define SEG_UCODE 3  // user code
 #define SEG_UDATA 4  // user data+stack
 #define SEG_TSS   5  // this process's task state
+#define SEG_KCPU  6  // kernel per-cpu data, in %gs
 
 #define SEG_PRESENT      0b10000000
 #define SEG_RING0        0b00000000
@@ -33,7 +34,7 @@
 #define SEG_32BIT        0b01000000
 #define SEG_4K           0b10000000
 
-#define NSEGS     6
+#define NSEGS     7
 
 struct segdesc {
     uint16_t limit_lo;
@@ -51,6 +52,7 @@ struct gdtr {
 } __attribute__((packed)); // here `packed` is critical!
 
 void gdt_set_entry(struct segdesc *seg, uint32_t base, uint32_t limit, uint8_t access, uint8_t flags);
-void gdt_init(void);
+struct cpu;
+void gdt_init(struct cpu *c);
 
 #endif /* GDT_H */
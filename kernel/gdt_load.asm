@@ -22,9 +22,7 @@ gdt_load:
     mov es, ax
     mov fs, ax
     mov ss, ax
-
-    mov ax, 0x18                ; UCODE
-    mov gs, ax
+    ; GS holds the per-cpu segment, loaded by gdt_init().
 
     ; Actually reload the CS register.
     jmp 0x08:.flush             ; 0x08 is a stand-in for your code segment
@@ -97,6 +97,9 @@ void idt_init() {
         idt_set_descriptor(vector, isr_stub_table[vector], SEG_KCODE << 3, IDT_DESCRIPTOR_EXTERNAL);
     }
 
+    idt_set_descriptor(IDT_IPI_TLB, isr_stub_table[IDT_IPI_TLB], SEG_KCODE << 3, IDT_DESCRIPTOR_EXTERNAL);
+    idt_set_descriptor(IDT_LAPIC_SPURIOUS, isr_stub_table[IDT_LAPIC_SPURIOUS], SEG_KCODE << 3, IDT_DESCRIPTOR_EXTERNAL);
+
     idt_set_descriptor(IDT_TRAP_SYSCALL, isr_stub_table[IDT_TRAP_SYSCALL], SEG_KCODE << 3, IDT_DESCRIPTOR_CALL);
 
     // Setup the IDTR register value.
@@ -108,3 +111,8 @@ void idt_init() {
 
     /* __asm__ __volatile__ ( "int $0":: ); */
 }
+
+/** Load the IDT, set up by idt_init(), on an application processor. */
+void idt_init_ap(void) {
+    idt_load((uint32_t) &idtr);
+}
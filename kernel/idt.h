@@ -43,6 +43,10 @@
 #define IDT_IRQ_ERROR      19
 #define IDT_IRQ_SIZE_MAX   48
 
+// Local APIC vectors, see lapic.c. Not acknowledged to the PIC.
+#define IDT_IPI_TLB        48     // flush the TLB, see tlb_shootdown()
+#define IDT_LAPIC_SPURIOUS 63     // low 4 bits must be set on P6
+
 #include "idt_defs.h"
 
 #define IDT_DESCRIPTOR_X32_TASK       0x05
@@ -82,6 +86,7 @@ struct idtr {
 } __attribute__((packed));
 
 struct interrupt_state {
+  uint32_t gs;
   uint32_t ds;
   uint32_t edi, esi, ebp, useless, ebx, edx, ecx, eax;
   uint32_t int_no, err_code;
@@ -93,5 +98,6 @@ typedef void (*isr_fn)(struct interrupt_state *);
 
 void isr_register(uint8_t int_no, isr_fn handler);
 void idt_init(void);
+void idt_init_ap(void);
 
 #endif /* IDT_H */
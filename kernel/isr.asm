@@ -43,12 +43,14 @@ isr_wrapper:
     ; EAX.
     pushad
 
-    ; Save DS (as lower 16 bits).
+    ; Save DS and GS (as lower 16 bits). ES and FS are always equal to DS.
     mov eax, ds
     push eax
+    mov eax, gs
+    push eax
 
     ; Push a pointer to the current stuff on stack, which are:
-    ;   - DS
+    ;   - GS, DS
     ;   - EDI, ESI, EBP, ESP, EBX, EDX, ECX, EAX
     ;   - Interrupt number, Error code
     ;   - EIP, CS, EFLAGS, User's ESP, SS (these are previously pushed
@@ -63,6 +65,7 @@ isr_wrapper:
     mov ds, ax
     mov es, ax
     mov fs, ax
+    mov ax, 0x30                ; SEG_KCPU, this cpu's data for mycpu()
     mov gs, ax
 
     ; CLears Direction flag. C code following the sysV ABI requires DF to be
@@ -77,12 +80,14 @@ isr_wrapper:
 global trapret
 trapret:
 
-    ; Restore previous segment descriptor.
+    ; Restore previous segment descriptors. A kernel GS now refers to the
+    ; cpu we return on, which needn't be the one we were interrupted on.
+    pop eax
+    mov gs, ax
     pop eax
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
 
     ; Restores EDI, ESI, EBP, ESP, EBX, EDX, ECX, EAX.
     popad
@@ -147,6 +152,10 @@ isr_no_err_stub  45
 isr_no_err_stub  46
 isr_no_err_stub  47
 
+; Local APIC: TLB shootdown IPI, spurious interrupt
+isr_no_err_stub  48
+isr_no_err_stub  63
+
 ; syscall
 isr_no_err_stub  64
 
@@ -160,5 +169,7 @@ isr_stub_table:
     dd isr_stub_%+i
 %assign i i+1
 %endrep
-    times (64 - 47 - 1) dd 0
+    dd isr_stub_48
+    times (63 - 48 - 1) dd 0
+    dd isr_stub_63
     dd isr_stub_64
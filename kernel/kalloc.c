@@ -2,31 +2,84 @@
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
 /* Lifted from https://github.com/mit-pdos/xv6-public/blob/master/kalloc.c */
+//
+// Frames are managed by a binary buddy allocator: free blocks of 2^order
+// contiguous frames, naturally aligned, are kept in one list per order.
+// Allocations split larger blocks, frees merge a block with its buddy
+// whenever the latter is free too. kalloc()/kfree() are the order 0 case.
 
 #include "drivers/screen.h"
 #include "lib/string.h"
+#include "cpu.h"
 #include "paging.h"
+#include "pmem.h"
 #include "spinlock.h"
+#include "swap.h"
 
 #include "kalloc.h"
 
-#define KMEM_SENTINEL (struct frame *)&kmem.freelist
-
 
 /** Kernel heap address range. Starts above kernel code. */
 uint32_t kheap_start;
 uint32_t kheap_end = 0x07fe0000; // overriden dynamically
 
+/** Bookkeeping of all frames, indexed by physical frame number. */
+struct frame_info *frame_info_table;
+
+/** Free list link, stored in the first frame of a free block. */
 struct frame {
   struct frame *next;
+  struct frame *prev;
 };
 
 struct {
   struct spinlock lock;
   int use_lock;
-  struct frame *freelist;
+  // Circular lists, each head being its own sentinel.
+  struct frame freelist[KALLOC_MAX_ORDER + 1];
+  uint32_t nfree[KALLOC_MAX_ORDER + 1];  // number of free blocks per order
 } kmem;
 
+/**
+ * Pool of frames zeroed ahead of time by the scheduler when it has nothing
+ * to run, so that page table and user page allocations don't have to.
+ */
+struct {
+  struct spinlock lock;
+  struct frame *list;   // linked through the first word, cleared on pop
+  uint32_t count;
+  uint32_t high;        // high-water mark: stop zeroing beyond
+  uint32_t hits;        // kalloc_zeroed() served from the pool
+  uint32_t misses;      // kalloc_zeroed() had to zero synchronously
+} zpool;
+
+static void
+freelist_push(struct frame *f, uint32_t order)
+{
+  struct frame *head = &kmem.freelist[order];
+  f->next = head->next;
+  f->prev = head;
+  head->next->prev = f;
+  head->next = f;
+  kmem.nfree[order]++;
+
+  struct frame_info *fi = frame_info(V2P(f));
+  fi->order = order;
+  fi->flags |= FRAME_FREE;
+}
+
+static void buddy_free(uint32_t pa, uint32_t order);
+
+static void
+freelist_remove(struct frame *f, uint32_t order)
+{
+  f->prev->next = f->next;
+  f->next->prev = f->prev;
+  kmem.nfree[order]--;
+
+  frame_info(V2P(f))->flags &= ~FRAME_FREE;
+}
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -35,14 +88,28 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  // The frame bookkeeping table is carved at the start of the first range.
+  uint32_t table_sz = (phys_end >> PTXSHIFT) * sizeof(struct frame_info);
+  frame_info_table = vstart;
+  vstart = (char*)vstart + PGROUNDUP(table_sz);
+  if((char*)vstart >= (char*)vend)
+    panic("kinit1: frame table too large");
+  memset(frame_info_table, 0, table_sz);
+
   kheap_start = (uint32_t)vstart;
+  kheap_end = phys_end;
 
-  // Be explicit about the sentinel value. Xv6 uses 0.
-  kmem.freelist = KMEM_SENTINEL;
+  for(uint32_t o = 0; o <= KALLOC_MAX_ORDER; o++){
+    kmem.freelist[o].next = kmem.freelist[o].prev = &kmem.freelist[o];
+    kmem.nfree[o] = 0;
+  }
 
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
 
+  initlock(&zpool.lock, "zpool");
+  zpool.high = ZPOOL_HIGH_DEFAULT;
+
   freerange(vstart, vend);
   // dump_freelist();
 }
@@ -50,75 +117,398 @@ kinit1(void *vstart, void *vend)
 void
 kinit2(void *vstart, void *vend)
 {
-  kheap_end = (uint32_t)vend;
+  kheap_end = V2P(vend);
   freerange(vstart, vend);
   kmem.use_lock = 1;
   dump_freelist();
 }
 
+// Give the usable frames of a range to the buddy allocator. Frames are handed
+// over as the largest aligned blocks that fit, without being written to: the
+// cost depends on the number of blocks, not on the amount of memory. Blocks
+// get split on allocation.
 void
 freerange(void *vstart, void *vend)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint32_t)vstart);
-  for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
-    kfree(p);
+  uint32_t pa = V2P(PGROUNDUP((uint32_t)vstart));
+  uint32_t end = V2P(PGROUNDDOWN((uint32_t)vend));
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  while(pa < end){
+    if(!pmem_usable(pa)){
+      pa += PGSIZE;
+      continue;
+    }
+    uint32_t order = 0;
+    while(order < KALLOC_MAX_ORDER){
+      uint32_t size = PGSIZE << (order + 1);
+      if(pa % size || pa + size > end || !pmem_usable_range(pa, pa + size))
+        break;
+      order++;
+    }
+    buddy_free(pa, order);
+    pa += PGSIZE << order;
+  }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Give the block of 2^order frames at physical address pa back to the free
+// lists. Must hold kmem.lock.
+static void
+buddy_free(uint32_t pa, uint32_t order)
+{
+  if(frame_info(pa)->flags & FRAME_FREE)
+    panic("kfree: double free");
+
+  // Merge with the buddy as long as it is a free block of the same order.
+  // Frames never given to the allocator are never marked free, so they stop
+  // the merging.
+  for(; order < KALLOC_MAX_ORDER; order++){
+    uint32_t buddy = pa ^ (PGSIZE << order);
+    if(buddy + (PGSIZE << order) > phys_end)
+      break;
+    struct frame_info *bi = frame_info(buddy);
+    if(!(bi->flags & FRAME_FREE) || bi->order != order)
+      break;
+    freelist_remove((struct frame*)P2V(buddy), order);
+    if(buddy < pa)
+      pa = buddy;
+  }
+  freelist_push((struct frame*)P2V(pa), order);
+}
+
+// Take a block of 2^order frames from the free lists. Must hold kmem.lock.
+static struct frame*
+buddy_alloc(uint32_t order)
+{
+  // Smallest free block that is large enough.
+  uint32_t o;
+  for(o = order; o <= KALLOC_MAX_ORDER; o++){
+    if(kmem.freelist[o].next != &kmem.freelist[o])
+      break;
+  }
+  if(o > KALLOC_MAX_ORDER)
+    return 0;
+
+  struct frame *r = kmem.freelist[o].next;
+  freelist_remove(r, o);
+  // Split it, giving back the upper halves.
+  while(o > order){
+    o--;
+    freelist_push((struct frame*)((char*)r + (PGSIZE << o)), o);
+  }
+  return r;
+}
+
+// Give n frames of this cpu's cache back to the buddy allocator. Must be
+// called with interrupts off.
+static void
+frame_cache_drain(struct frame_cache *fc, uint32_t n)
+{
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  for(; n > 0 && fc->count > 0; n--)
+    buddy_free(V2P(fc->frames[--fc->count]), 0);
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  fc->drains++;
+}
+
+// Free the block of 2^order pages of physical memory pointed at by v, which
+// normally should have been returned by a call to kalloc_pages(order). (The
+// exception is when initializing the allocator; see kinit above.)
+void
+kfree_pages(char *v, uint32_t order)
+{
+  uint32_t pa = V2P(v);
+
+  if(order > KALLOC_MAX_ORDER || pa % (PGSIZE << order) ||
+     (uint32_t)v < kheap_start || pa + (PGSIZE << order) > kheap_end)
+    panic("kfree");
+
+#ifdef KALLOC_DEBUG
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, PGSIZE << order);
+#endif
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  buddy_free(pa, order);
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Allocate a block of 2^order physically contiguous 4096-byte pages, aligned
+// on its size. Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+char*
+kalloc_pages(uint32_t order)
+{
+  struct frame *r;
+
+  if(order > KALLOC_MAX_ORDER)
+    return 0;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  r = buddy_alloc(order);
+  if(kmem.use_lock)
+    release(&kmem.lock);
+
+  // Cached frames may be what prevents merging a large enough block.
+  if(r == 0 && order > 0){
+    pushcli();
+    struct frame_cache *fc = &mycpu()->fcache;
+    uint32_t cached = fc->count;
+    if(cached)
+      frame_cache_drain(fc, cached);
+    popcli();
+    if(cached)
+      return kalloc_pages(order);
+  }
+  return (char*)r;
 }
 
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// call to kalloc().
 //
-// Note that the free list starts with the highest numbered free frame and
-// begins sorted in reverse order.
+// The frame goes to this cpu's cache. When full, half of it is given back
+// to the buddy allocator in one go.
 void
 kfree(char *v)
 {
-  struct frame *r;
-
   if((uint32_t)v % PGSIZE || (uint32_t)v < kheap_start || V2P(v) >= kheap_end)
     panic("kfree");
 
+#ifdef KALLOC_DEBUG
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = (struct frame*)v;
-  r->next = kmem.freelist;      // points to the previous
-  kmem.freelist = r;            // points to the last
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  pushcli();
+  struct frame_cache *fc = &mycpu()->fcache;
+  if(fc->count == FRAME_CACHE_SIZE)
+    frame_cache_drain(fc, FRAME_CACHE_BATCH);
+  fc->frames[fc->count++] = v;
+  popcli();
+}
+
+// Take one more reference to the user frame at v, i.e. map it in one more
+// place. Frames shared by several address spaces (copy-on-write) are only
+// freed when the last mapping goes away, see kref_put().
+void
+kref_get(char *v)
+{
+  __sync_add_and_fetch(&frame_info(V2P(v))->ref, 1);
+}
+
+// Drop a reference to the user frame at v, freeing it with the last one.
+void
+kref_put(char *v)
+{
+  struct frame_info *fi = frame_info(V2P(v));
+  if(fi->ref == 0)
+    panic("kref_put");
+  if(__sync_sub_and_fetch(&fi->ref, 1) == 0)
+    kfree(v);
+}
+
+// Same as kref_put() for a block of 2^order frames, e.g. a huge page.
+void
+kref_put_pages(char *v, uint32_t order)
+{
+  struct frame_info *fi = frame_info(V2P(v));
+  if(fi->ref == 0)
+    panic("kref_put_pages");
+  if(__sync_sub_and_fetch(&fi->ref, 1) == 0)
+    kfree_pages(v, order);
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+//
+// Frames come from this cpu's cache, refilled by batches from the buddy
+// allocator, so the common case takes no lock.
 char*
 kalloc(void)
+{
+  char *r = 0;
+
+  pushcli();
+  struct frame_cache *fc = &mycpu()->fcache;
+  if(fc->count > 0){
+    fc->hits++;
+  } else {
+    if(kmem.use_lock)
+      acquire(&kmem.lock);
+    struct frame *f;
+    while(fc->count < FRAME_CACHE_BATCH && (f = buddy_alloc(0)) != 0)
+      fc->frames[fc->count++] = (char*)f;
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    fc->refills++;
+  }
+  if(fc->count > 0)
+    r = fc->frames[--fc->count];
+  popcli();
+
+  // Out of frames: swap cold user pages out, they land in this cpu's cache.
+  if(r == 0 && swap_reclaim())
+    return kalloc();
+  return r;
+}
+
+// Take a frame from the pool of pre-zeroed frames. Must hold zpool.lock.
+static char*
+zpool_pop(void)
 {
   struct frame *r;
 
+  if((r = zpool.list) != 0){
+    zpool.list = r->next;
+    zpool.count--;
+    zpool.hits++;
+    r->next = 0;
+  }
+  return (char*)r;
+}
+
+// Allocate one zeroed page. Taken from the pool of pre-zeroed frames when
+// possible, otherwise zeroed on the spot.
+char*
+kalloc_zeroed(void)
+{
+  char *r;
+
+  acquire(&zpool.lock);
+  if((r = zpool_pop()) == 0)
+    zpool.misses++;
+  release(&zpool.lock);
+
+  if(r)
+    return r;
+
+  char *mem = kalloc();
+  if(mem)
+    memset(mem, 0, PGSIZE);
+  return mem;
+}
+
+// Allocate one zeroed page only if one is ready in the pool, for callers
+// which may as well do without, e.g. speculative mappings. Returns 0 if the
+// pool is empty.
+char*
+kalloc_zeroed_pooled(void)
+{
+  acquire(&zpool.lock);
+  char *r = zpool_pop();
+  release(&zpool.lock);
+  return r;
+}
+
+// Set the number of pre-zeroed frames to keep. Frames beyond it are given
+// back. Returns the previous number.
+uint32_t
+kalloc_zeroed_set_high(uint32_t high)
+{
+  struct frame *r;
+
+  acquire(&zpool.lock);
+  uint32_t old = zpool.high;
+  zpool.high = high;
+  while(zpool.count > high){
+    r = zpool.list;
+    zpool.list = r->next;
+    zpool.count--;
+    release(&zpool.lock);
+    kfree((char*)r);
+    acquire(&zpool.lock);
+  }
+  release(&zpool.lock);
+  return old;
+}
+
+// Zero one frame for the pool if it is below its high-water mark. Called by
+// the scheduler when idle. Returns whether there was anything to do.
+bool
+kalloc_zero_idle(void)
+{
+  acquire(&zpool.lock);
+  bool full = zpool.count >= zpool.high;
+  release(&zpool.lock);
+  if(full)
+    return false;
+
+  struct frame *r = (struct frame*)kalloc();
+  if(r == 0)
+    return false;
+  memset(r, 0, PGSIZE);
+
+  acquire(&zpool.lock);
+  r->next = zpool.list;
+  zpool.list = r;
+  zpool.count++;
+  release(&zpool.lock);
+  return true;
+}
+
+// Number of frames in [pa_start, pa_end) sitting in the buddy allocator free
+// lists. Frames in cpu caches are not accounted for.
+uint32_t
+kalloc_count_free(uint32_t pa_start, uint32_t pa_end)
+{
+  uint32_t n = 0;
+
   if(kmem.use_lock)
     acquire(&kmem.lock);
-  r = kmem.freelist;
-  if (r == KMEM_SENTINEL)
-    r = 0;
-  else
-    kmem.freelist = r->next;
+  for(uint32_t o = 0; o <= KALLOC_MAX_ORDER; o++){
+    for(struct frame *f = kmem.freelist[o].next; f != &kmem.freelist[o];
+        f = f->next){
+      uint32_t start = V2P(f), end = start + (PGSIZE << o);
+      if(start < pa_start)
+        start = pa_start;
+      if(end > pa_end)
+        end = pa_end;
+      if(start < end)
+        n += (end - start) / PGSIZE;
+    }
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
-  return (char*)r;
+  return n;
 }
 
+/**
+ * Print free blocks per order. For each order, the fragmentation figure is
+ * the share of free memory lying in smaller blocks, i.e. unusable for an
+ * allocation of that order: when it nears 100%, such allocations will start
+ * failing although memory is still available.
+ */
 void dump_freelist() {
-    struct frame *p = kmem.freelist;
-    int nframes = 0;
-    cprintf("kernel heap: start=0x%p", p);
-    while (p->next != KMEM_SENTINEL) {
-        p = p->next;
-        nframes++;
+    uint32_t nframes = 0;
+    for(uint32_t o = 0; o <= KALLOC_MAX_ORDER; o++)
+        nframes += kmem.nfree[o] << o;
+    cprintf("kernel heap: number of free frames: %d\n", nframes);
+
+    uint32_t smaller = 0;
+    for(uint32_t o = 0; o <= KALLOC_MAX_ORDER; o++){
+        cprintf("  order %d: free blocks=%d, fragmentation=%d%%\n",
+                o, kmem.nfree[o], nframes ? smaller * 100 / nframes : 0);
+        smaller += kmem.nfree[o] << o;
     }
-    cprintf(" end=0x%p, number of free frames: %d\n", p, nframes);
+
+    for(int i = 0; i < MAX_CPUS; i++){
+        struct frame_cache *fc = &cpus[i].fcache;
+        if(fc->hits + fc->refills + fc->count == 0)
+            continue;
+        cprintf("  cpu %d cache: frames=%d, hits=%d, refills=%d, drains=%d\n",
+                i, fc->count, fc->hits, fc->refills, fc->drains);
+    }
+
+    cprintf("  zeroed pool: frames=%d/%d, hits=%d, misses=%d\n",
+            zpool.count, zpool.high, zpool.hits, zpool.misses);
 }
@@ -2,13 +2,72 @@
 #define KALLOC_H
 
 
+#include <stdbool.h>
 #include <stdint.h>
 
+/** Largest block handed out by the buddy allocator: 2^10 frames = 4MiB. */
+#define KALLOC_MAX_ORDER 10
+
+/** Frame flags. */
+#define FRAME_FREE    0x01  /** Heads a free block of the buddy allocator. */
+#define FRAME_SLAB    0x02  /** Part of a slab, order is the slab's. */
+#define FRAME_KMALLOC 0x04  /** Heads a large kmalloc() block of order. */
+
+/**
+ * Per-frame bookkeeping, one entry for each physical frame below phys_end.
+ */
+struct frame_info {
+  uint8_t  order;   /** Order of the block headed by this frame. */
+  uint8_t  flags;
+  uint16_t ref;     /** User page table entries mapping this frame. */
+};
+
+extern struct frame_info *frame_info_table;
+
+/** Frames kept by each cpu in front of the buddy allocator. */
+#define FRAME_CACHE_SIZE  32
+/** Frames moved at once between a cpu cache and the buddy allocator. */
+#define FRAME_CACHE_BATCH 16
+
+/**
+ * Per-cpu magazine of free frames (see struct cpu). Only ever accessed by its
+ * cpu with interrupts off, hence lock free.
+ */
+struct frame_cache {
+  uint32_t count;
+  char    *frames[FRAME_CACHE_SIZE];
+  uint32_t hits;      /** Allocations served without touching kmem. */
+  uint32_t refills;   /** Batches taken from the buddy allocator. */
+  uint32_t drains;    /** Batches given back to the buddy allocator. */
+};
+
+/** Bookkeeping of the frame at physical address pa. */
+static inline struct frame_info *
+frame_info(uint32_t pa)
+{
+  return &frame_info_table[pa >> 12];
+}
+
+/** Default number of zeroed frames prepared while idle, see kalloc_zeroed(). */
+#define ZPOOL_HIGH_DEFAULT 64
+/** Most that can be asked for with the zpool() system call. */
+#define ZPOOL_HIGH_MAX     1024
+
 void kinit1(void *vstart, void *vend);
 void kinit2(void *vstart, void *vend);
 void freerange(void *vstart, void *vend);
 void kfree(char *v);
 char* kalloc(void);
+char* kalloc_pages(uint32_t order);
+void kfree_pages(char *v, uint32_t order);
+void kref_get(char *v);
+void kref_put(char *v);
+void kref_put_pages(char *v, uint32_t order);
+char* kalloc_zeroed(void);
+char* kalloc_zeroed_pooled(void);
+uint32_t kalloc_zeroed_set_high(uint32_t high);
+bool kalloc_zero_idle(void);
+uint32_t kalloc_count_free(uint32_t pa_start, uint32_t pa_end);
 void dump_freelist();
 
 #endif /* KALLOC_H */
@@ -2,28 +2,46 @@
 #include "drivers/ide.h"
 #include "drivers/ioapic.h"
 #include "drivers/kbd.h"
+#include "drivers/lapic.h"
 #include "drivers/screen.h"
 #include "drivers/timer.h"
 #include "drivers/uart.h"
+#include "lib/debug.h"
+#include "lib/string.h"
 #include "cpu.h"
 #include "gdt.h"
 #include "idt.h"
 #include "kalloc.h"
+#include "ksm.h"
+#include "low_level.h"
+#include "pagecache.h"
 #include "paging.h"
 #include "pic.h"
 #include "pmem.h"
 #include "proc.h"
+#include "shm.h"
+#include "slab.h"
 #include "spinlock.h"
+#include "swap.h"
+#include "vmalloc.h"
 
 extern char __k_start, __k_end; // defined in kernel.lds
+extern pde_t entrypgdir[];        // kernel_entry.asm
+extern char _binary_boot_entryother_start[], _binary_boot_entryother_size[];
+
+static void reserve_ap_stacks(void);
+static void startothers(void);
+
+static struct cpu *starting;    // AP being started by startothers()
+static char *apstacks[MAX_CPUS];  // see reserve_ap_stacks()
 
 void main(const struct pmem_info *mem_info) {
+    gdt_init(&cpus[0]);  // first, for mycpu() in locks
+
     consoleinit();
     print("-------->>KERNEL START<<--------\n");
     print("FOUDIL WAS HERE\n(c) 20222-2023\n");
 
-    gdt_init();
-
     pmem_init(mem_info);
     cprintf("Max usable kernel memory address: 0x%p\n", phys_end - 1);
 
@@ -45,17 +63,27 @@ void main(const struct pmem_info *mem_info) {
     print("Pagination enabled\n");
 
     acpi_init();
+    lapic_init();    // this cpu's interrupt controller
+    cpu_init();
+    print("CPU state initialized\n");
     ioapicinit();    // another interrupt controller
     uartinit();      // serial port
     print("UART COM1 serial port enabled\n");
+    reserve_ap_stacks();  // while only low memory is free
 
     /* sti();             // Enable interrupts. Now done by scheduler() */
 
     kinit2(P2V(4*1024*1024), P2V(phys_end));
+    pmem_reclaim_acpi();
+    pmem_dump();
     print("Kernel heap allocator initialized\n");
+    slab_init();
+    print("Slab allocator initialized\n");
+    vmalloc_init();
+    pagecache_init();
+    shm_init();
+    ksm_init();
 
-    cpu_init();
-    print("CPU state initialized\n");
     process_init();
     print("Process table ready\n");
 
@@ -64,9 +92,74 @@ void main(const struct pmem_info *mem_info) {
 
     ide_init();
     print("IDE disk initialized\n");
+    swap_init();
 
+    startothers();   // start other processors
+    mycpu()->started = 1;
     scheduler();
 
     while (1)   // CPU idles
         __asm__ __volatile__( "hlt" );
 }
+
+// Common CPU setup code.
+static void mpmain(void) {
+    cprintf("cpu%d: starting\n", mycpu() - cpus);
+    xchg(&mycpu()->started, 1); // tell startothers() we're up
+    scheduler();     // start running processes
+}
+
+// Other CPUs jump here from entryother.asm.
+static void mpenter(void) {
+    gdt_init(starting);
+    paging_init_ap();
+    idt_init_ap();
+    lapic_init();
+    mpmain();
+}
+
+// Application processors start on entrypgdir, which only maps the first
+// 4MiB: their first stack must lie there, so it's taken before kinit2()
+// frees memory above.
+static void reserve_ap_stacks(void) {
+    for (struct cpu *c = cpus; c < cpus + ncpu; c++) {
+        if (c == mycpu())
+            continue;
+        char *stack = kalloc();
+        if (stack == 0)
+            panic("reserve_ap_stacks: out of memory");
+        assert(V2P(stack) + PGSIZE <= 4*1024*1024);
+        apstacks[c - cpus] = stack;
+    }
+}
+
+// Start the non-boot (AP) processors, one at a time.
+static void startothers(void) {
+    // Write entry code to unused memory at AP_ENTRY.
+    // The linker has placed the image of entryother.asm in
+    // _binary_boot_entryother_start.
+    char *code = P2V(AP_ENTRY);
+    memmove(code, _binary_boot_entryother_start,
+            (uint32_t)_binary_boot_entryother_size);
+
+    for (struct cpu *c = cpus; c < cpus + ncpu; c++) {
+        if (c == mycpu())  // We've started already.
+            continue;
+
+        // Tell entryother.asm what stack to use, where to enter, and what
+        // pgdir to use. We cannot use kpgdir yet, because the AP processor
+        // is running in low memory, so we use entrypgdir for the APs too,
+        // and a stack from low memory, see reserve_ap_stacks().
+        char *stack = apstacks[c - cpus];
+        *(void**)(code-4) = stack + PGSIZE;
+        *(void(**)(void))(code-8) = mpenter;
+        *(uint32_t*)(code-12) = V2P(entrypgdir);
+        starting = c;
+
+        lapic_startap(c->apicid, V2P(code));
+
+        // wait for cpu to finish mpmain()
+        while (c->started == 0)
+            pause();
+    }
+}
@@ -64,6 +64,7 @@ NPDENTRIES  equ 1024              ; Number directory entries per page directory
 ; https://github.com/amanuel2/OS_Mirror/blob/master/boot.asm
 ; Equivalent of xv6's entrypgdir[] https://github.com/mit-pdos/xv6-public/blob/eeb7b415dbcb12cc362d0783e41c3d1f44066b17/main.c#L103
 align 0x1000
+global entrypgdir               ; also used by boot/entryother.asm
 entrypgdir:
     ; This page directory entry identity-maps the first 4MB of the 32-bit physical address space.
     ; All bits are clear except the following:
@@ -0,0 +1,231 @@
+#include "drivers/screen.h"
+#include "drivers/timer.h"
+#include "lib/debug.h"
+#include "lib/string.h"
+#include "kalloc.h"
+#include "paging.h"
+#include "proc.h"
+#include "slab.h"
+
+#include "ksm.h"
+
+struct ksm_stats ksm_stats;
+
+// A merged frame. The table holds a reference on it, dropped at the start of
+// a round once no one else maps it.
+struct ksm_page {
+  uint32_t         hash;
+  char            *frame;
+  struct ksm_page *next;    // hash chain
+};
+
+// A page seen in this round, mapped by p at va. Only a hint: it is checked
+// again before merging.
+struct ksm_item {
+  struct process *p;
+  uint16_t        pid;
+  uint32_t        va;
+  uint32_t        hash;
+};
+
+// Only used by the scheduler, with ptable.lock held.
+static struct {
+  struct ksm_page *stable[KSM_NHASH];
+  struct ksm_item  unstable[KSM_NUNSTABLE];
+  struct kmem_cache *pages;
+  uint32_t nstable;
+} ksm;
+
+static uint32_t
+ksm_hash(const char *page)
+{
+  const uint32_t *w = (const uint32_t*)page;
+  uint32_t h = 2166136261U;
+  for(uint32_t i = 0; i < PGSIZE / sizeof(*w); i++)
+    h = (h ^ w[i]) * 16777619U;
+  return h;
+}
+
+// PTE of a page worth merging: private, anonymous and mapped once.
+static bool
+ksm_candidate(pte_t pte)
+{
+  return (pte & (PTE_P|PTE_U|PTE_W|PTE_COW|PTE_SHARED)) == (PTE_P|PTE_U|PTE_W)
+         && frame_info(PTE_ADDR(pte))->ref == 1;
+}
+
+// Have the candidate page at pte map frame read-only instead, copy-on-write.
+// The old frame is freed. Returns with pgdir's TLB flushed.
+static void
+ksm_remap(pde_t *pgdir, pte_t *pte, char *frame)
+{
+  char *old = P2V(PTE_ADDR(*pte));
+
+  if(old != frame)
+    kref_get(frame);
+  *pte = V2P(frame) | (PTE_FLAGS(*pte) & ~(PTE_W|PTE_A|PTE_D)) | PTE_COW;
+  tlb_flush_pgdir(pgdir);
+  if(old != frame){
+    kref_put(old);
+    ksm_stats.merged++;
+  }
+}
+
+// Page table entry of the unstable item it, if it still maps a candidate.
+// Its process is then pinned, unless it's p, being scanned: see ksm_merge().
+static pte_t *
+ksm_item_pte(struct ksm_item *it, struct process *p)
+{
+  struct process *q = it->p;
+  if(q == 0 || q->pid != it->pid || (q != p && !process_pin(q)))
+    return 0;
+  pte_t *pte = walkpgdir(q->pgdir, it->va, false);
+  if(pte == 0 || (*pte & PTE_PS) || !ksm_candidate(*pte)){
+    if(q != p)
+      process_unpin(q);
+    return 0;
+  }
+  return pte;
+}
+
+// Try to merge the candidate page at pte, mapped by p at va.
+static void
+ksm_merge(struct process *p, uint32_t va, pte_t *pte)
+{
+  char *mem = P2V(PTE_ADDR(*pte));
+  uint32_t h = ksm_hash(mem);
+
+  // Same content as a merged frame?
+  for(struct ksm_page *kp = ksm.stable[h % KSM_NHASH]; kp; kp = kp->next){
+    if(kp->hash == h && memcmp(kp->frame, mem, PGSIZE) == 0){
+      ksm_remap(p->pgdir, pte, kp->frame);
+      return;
+    }
+  }
+
+  // Same content as a page seen earlier in the round? Both then map the
+  // earlier one's frame, which becomes stable.
+  struct ksm_item *it = &ksm.unstable[h % KSM_NUNSTABLE];
+  pte_t *qpte;
+  if(it->hash == h && (it->p != p || it->va != va) &&
+     (qpte = ksm_item_pte(it, p)) != 0){
+    struct process *q = it->p;
+    bool same = memcmp(P2V(PTE_ADDR(*qpte)), mem, PGSIZE) == 0;
+    struct ksm_page *kp = same ? kmem_cache_alloc(ksm.pages) : 0;
+    if(kp){
+      kp->hash = h;
+      kp->frame = P2V(PTE_ADDR(*qpte));
+      kref_get(kp->frame);    // the table's
+      kp->next = ksm.stable[h % KSM_NHASH];
+      ksm.stable[h % KSM_NHASH] = kp;
+      ksm.nstable++;
+      ksm_remap(q->pgdir, qpte, kp->frame);
+      ksm_remap(p->pgdir, pte, kp->frame);
+      it->p = 0;
+    }
+    if(q != p)
+      process_unpin(q);
+    if(same)
+      return;
+  }
+
+  it->p = p;
+  it->pid = p->pid;
+  it->va = va;
+  it->hash = h;
+}
+
+/**
+ * Scan p's pages from p->ksmhand, hashing up to *budget candidates, which is
+ * decreased accordingly. Returns whether the scan of p reached its end for
+ * this round. Must hold ptable.lock.
+ */
+bool
+ksm_scan(struct process *p, uint32_t *budget)
+{
+  uint32_t va = p->ksmhand;
+  bool flush = false, done = false;
+
+  for(uint32_t i = 0; i < KSM_SCAN_MAX && *budget > 0; i++, va += PGSIZE){
+    if(va >= KERNBASE){
+      done = true;
+      va = 0;
+      break;
+    }
+    pde_t pde = p->pgdir[PDX(va)];
+    if((pde & (PTE_P|PTE_PS)) != PTE_P){
+      va = PGADDR(PDX(va) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    pte_t *pte = &((pte_t*)P2V(PTE_ADDR(pde)))[PTX(va)];
+    if(!ksm_candidate(*pte))
+      continue;
+
+    (*budget)--;
+    if(*pte & PTE_D){
+      // Written since last time: see whether it settles down.
+      *pte &= ~PTE_D;
+      flush = true;
+      ksm_stats.volatile_++;
+      continue;
+    }
+    ksm_stats.scanned++;
+    ksm_merge(p, va, pte);
+  }
+  p->ksmhand = va;
+
+  // The cleared dirty bits must be set again by the next writes.
+  if(flush)
+    tlb_flush_pgdir(p->pgdir);
+  return done;
+}
+
+// Start a new round: forget the pages seen, and drop merged frames nobody
+// maps anymore. Must hold ptable.lock.
+void
+ksm_round(void)
+{
+  memset(ksm.unstable, 0, sizeof(ksm.unstable));
+  for(uint32_t i = 0; i < KSM_NHASH; i++){
+    struct ksm_page **pp = &ksm.stable[i];
+    while(*pp){
+      struct ksm_page *kp = *pp;
+      if(frame_info(V2P(kp->frame))->ref != 1){
+        pp = &kp->next;
+        continue;
+      }
+      *pp = kp->next;
+      kref_put(kp->frame);
+      kmem_cache_free(ksm.pages, kp);
+      ksm.nstable--;
+    }
+  }
+  ksm_stats.rounds++;
+}
+
+/**
+ * Print merging statistics. Shared is the number of merged frames, sharing
+ * the number of mappings of them: memory saved is the difference. Must hold
+ * ptable.lock.
+ */
+void ksm_dump(void) {
+    uint32_t sharing = 0;
+    for(uint32_t i = 0; i < KSM_NHASH; i++)
+        for(struct ksm_page *kp = ksm.stable[i]; kp; kp = kp->next)
+            sharing += frame_info(V2P(kp->frame))->ref - 1;
+    uint32_t secs = (uint32_t)timer_ticks() / TIMER_FREQ_HZ;
+    if(secs == 0)
+        secs = 1;
+    cprintf("ksm: shared=%d sharing=%d saved=%dKiB merged=%d (%d/s) "
+            "scanned=%d volatile=%d rounds=%d\n",
+            ksm.nstable, sharing,
+            (sharing > ksm.nstable ? sharing - ksm.nstable : 0) * PGSIZE / 1024,
+            ksm_stats.merged, ksm_stats.merged / secs, ksm_stats.scanned,
+            ksm_stats.volatile_, ksm_stats.rounds);
+}
+
+void ksm_init(void) {
+    ksm.pages = kmem_cache_create("ksm_page", sizeof(struct ksm_page), 0, 0, 0);
+    if(ksm.pages == 0)
+        panic("ksm_init");
+}
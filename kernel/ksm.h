@@ -0,0 +1,41 @@
+/**
+ * Kernel same-page merging: while idle, the scheduler goes over the private
+ * anonymous pages of processes looking for identical content, and has them
+ * share a single frame, read-only. Writes get their own copy back through the
+ * copy-on-write fault path.
+ *
+ * Pages are hashed, then looked up among the merged frames (stable table),
+ * then among the pages seen so far in this round (unstable table). Pages
+ * written since the scanner last passed by (PTE_D) are deemed too volatile
+ * and left alone until the next round.
+ */
+#ifndef KSM_H
+#define KSM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KSM_NHASH       64      /** Stable table buckets. */
+#define KSM_NUNSTABLE   256     /** Unstable table entries. */
+/** Pages hashed per idle call. */
+#define KSM_SCAN_BATCH  16
+/** Page table entries looked at per process and call. */
+#define KSM_SCAN_MAX    1024
+
+struct ksm_stats {
+    uint32_t scanned;       /** Candidate pages hashed. */
+    uint32_t volatile_;     /** Pages skipped for having been written. */
+    uint32_t merged;        /** Pages whose frame was freed by merging. */
+    uint32_t rounds;        /** Full passes over all processes. */
+};
+
+extern struct ksm_stats ksm_stats;
+
+struct process;
+
+void ksm_init(void);
+bool ksm_scan(struct process *p, uint32_t *budget);
+void ksm_round(void);
+void ksm_dump(void);
+
+#endif /* KSM_H */
@@ -0,0 +1,181 @@
+/**
+ * LZ4 block format compression.
+ *
+ * A block is a series of sequences: a token byte holding the literal length
+ * (high nibble) and the match length minus LZ4_MINMATCH (low nibble), either
+ * extended by bytes that follow while they are 255, the literals, then the
+ * little endian 16-bit match offset backwards. The last sequence only holds
+ * literals, at least LZ4_LASTLITERALS of them.
+ */
+
+#include "lib/string.h"
+
+#include "lib/lz4.h"
+
+#define LZ4_MINMATCH     4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT      12     // no match starts closer to the end
+#define LZ4_MAX_OFFSET   65535
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+    uint32_t v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t
+hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/** Bytes needed by a sequence of LIT literals and a MLEN match, at most. */
+static inline uint32_t
+seqsize(uint32_t lit, uint32_t mlen)
+{
+    return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+static uint8_t *
+putlen(uint8_t *op, uint32_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/**
+ * Compresses LEN bytes from SRC into DST, of DSTLEN bytes. LEN must be below
+ * 64KiB. WORK points to LZ4_WORK_SIZE bytes of scratch memory.
+ * Returns the compressed size, or 0 if it would exceed DSTLEN.
+ */
+uint32_t
+lz4_compress(const void *src, uint32_t len, void *dst, uint32_t dstlen,
+             void *work)
+{
+    const uint8_t *base = src, *ip = base, *anchor = base;
+    const uint8_t *end = base + len;
+    uint8_t *op = dst, *oend = op + dstlen;
+    uint16_t *table = work;
+
+    memset(table, 0, LZ4_WORK_SIZE);
+
+    if (len > LZ4_MFLIMIT) {
+        const uint8_t *mflimit = end - LZ4_MFLIMIT;
+        const uint8_t *matchlimit = end - LZ4_LASTLITERALS;
+
+        for (ip++; ip < mflimit; ) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash(seq);
+            const uint8_t *ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *mp = ip + LZ4_MINMATCH;
+            const uint8_t *rp = ref + LZ4_MINMATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            uint32_t lit = ip - anchor;
+            uint32_t mlen = mp - ip - LZ4_MINMATCH;
+            uint32_t off = ip - ref;
+            if (seqsize(lit, mlen) > (uint32_t)(oend - op))
+                return 0;
+
+            uint8_t *token = op++;
+            *token = (lit < 15 ? lit : 15) << 4 | (mlen < 15 ? mlen : 15);
+            if (lit >= 15)
+                op = putlen(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = off & 0xFF;
+            *op++ = off >> 8;
+            if (mlen >= 15)
+                op = putlen(op, mlen - 15);
+
+            ip = anchor = mp;
+        }
+    }
+
+    uint32_t lit = end - anchor;
+    if (seqsize(lit, 0) > (uint32_t)(oend - op))
+        return 0;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15)
+        op = putlen(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - (uint8_t *) dst;
+}
+
+/** Reads an extended length at *IP, added to LEN. Returns -1 past END. */
+static int32_t
+getlen(const uint8_t **ip, const uint8_t *end, uint32_t len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= end)
+            return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+/**
+ * Decompresses the block of LEN bytes at SRC into DST, of DSTLEN bytes.
+ * Returns the decompressed size, or -1 if the block is malformed or doesn't
+ * fit.
+ */
+int32_t
+lz4_decompress(const void *src, uint32_t len, void *dst, uint32_t dstlen)
+{
+    const uint8_t *ip = src, *end = ip + len;
+    uint8_t *op = dst, *oend = op + dstlen;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        int32_t lit = token >> 4;
+        if (lit == 15 && (lit = getlen(&ip, end, lit)) < 0)
+            return -1;
+        if ((uint32_t) lit > (uint32_t)(end - ip) ||
+            (uint32_t) lit > (uint32_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == end)
+            break;      // last sequence
+
+        if (end - ip < 2)
+            return -1;
+        uint32_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (uint32_t)(op - (uint8_t *) dst))
+            return -1;
+
+        int32_t mlen = token & 15;
+        if (mlen == 15 && (mlen = getlen(&ip, end, mlen)) < 0)
+            return -1;
+        mlen += LZ4_MINMATCH;
+        if ((uint32_t) mlen > (uint32_t)(oend - op))
+            return -1;
+        for (const uint8_t *ref = op - off; mlen > 0; mlen--)
+            *op++ = *ref++;
+    }
+
+    return op - (uint8_t *) dst;
+}
@@ -0,0 +1,21 @@
+/**
+ * LZ4 block format compression, for swapped out pages (see zram.h).
+ *
+ * Made for speed rather than ratio: a single hash table probe per position,
+ * no match search. See https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ */
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+
+#define LZ4_HASH_BITS 12
+/** Work memory expected by lz4_compress(). */
+#define LZ4_WORK_SIZE ((1 << LZ4_HASH_BITS) * sizeof(uint16_t))
+
+uint32_t lz4_compress(const void *src, uint32_t len, void *dst,
+                      uint32_t dstlen, void *work);
+int32_t lz4_decompress(const void *src, uint32_t len, void *dst,
+                       uint32_t dstlen);
+
+#endif /* LZ4_H */
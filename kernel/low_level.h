@@ -42,4 +42,37 @@ static inline void outsl(uint16_t port, const void *addr, uint32_t cnt) {
                            : "d" (port) );
 }
 
+// CPUID leaf 1 feature flags (EDX)
+#define CPUID_FEAT_EDX_PSE   (1 << 3)   // Page size extension
+#define CPUID_FEAT_EDX_PGE   (1 << 13)  // Page global enable
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+                         uint32_t *ecx, uint32_t *edx) {
+    __asm__ __volatile__ ( "cpuid"
+                           : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                           : "a" (leaf), "c" (0) );
+}
+
+/** Time stamp counter: cpu cycles since reset. */
+static inline uint64_t rdtsc(void) {
+    uint64_t val;
+    __asm__ __volatile__ ( "rdtsc" : "=A" (val) );
+    return val;
+}
+
+/** Model specific registers. */
+#define MSR_APIC_BASE        0x1B
+#define MSR_APIC_BASE_BSP    (1 << 8)   // This is the bootstrap processor
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint64_t val;
+    __asm__ __volatile__ ( "rdmsr" : "=A" (val) : "c" (msr) );
+    return val;
+}
+
+/** Spin-wait loop hint, also easing hyper-threading siblings. */
+static inline void pause(void) {
+    __asm__ __volatile__ ( "pause" ::: "memory" );
+}
+
 #endif /* LOW_LEVEL_H */
@@ -0,0 +1,16 @@
+/**
+ * mmap() flags, shared with user programs.
+ */
+#ifndef MMAN_H
+#define MMAN_H
+
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+
+#define MAP_SHARED    0x01  /** Writes go to the device, seen by all. */
+#define MAP_PRIVATE   0x02  /** Writes are copied, private to the process. */
+#define MAP_ANONYMOUS 0x04  /** Zero-filled, no device. */
+
+#define MAP_FAILED    ((void *) -1)
+
+#endif /* MMAN_H */
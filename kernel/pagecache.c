@@ -0,0 +1,257 @@
+#include "drivers/ide.h"
+#include "drivers/screen.h"
+#include "fs/block.h"
+#include "lib/debug.h"
+#include "lib/string.h"
+#include "kalloc.h"
+#include "low_level.h"
+#include "paging.h"
+#include "proc.h"
+#include "slab.h"
+#include "spinlock.h"
+
+#include "pagecache.h"
+
+#define BLOCKS_PER_PAGE (PGSIZE / BLOCK_SIZE)
+
+struct page {
+  uint32_t     dev;
+  uint32_t     pgno;    // page index on the device, or image address
+  char        *frame;
+  bool         busy;    // being filled, see pagecache_get_fill()
+  struct page *next;    // hash chain
+};
+
+static struct {
+  struct spinlock lock;
+  struct page *hash[PAGECACHE_NHASH];
+  struct kmem_cache *pages;
+  uint32_t count;
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+} pcache;
+
+// Image pages are keyed by address, folded so that consecutive pages spread.
+static inline struct page **
+pagecache_bucket(uint32_t dev, uint32_t pgno)
+{
+  return &pcache.hash[((pgno ^ (pgno >> PTXSHIFT)) * 31 + dev)
+                      % PAGECACHE_NHASH];
+}
+
+static struct page *
+pagecache_lookup(uint32_t dev, uint32_t pgno)
+{
+  for(struct page *pg = *pagecache_bucket(dev, pgno); pg; pg = pg->next)
+    if(pg->dev == dev && pg->pgno == pgno)
+      return pg;
+  return 0;
+}
+
+// Read or write a whole page through the block layer.
+static bool
+pagecache_io(uint32_t dev, uint32_t pgno, char *frame, bool write)
+{
+  struct block_req *b = kmalloc(sizeof(*b));
+  if(b == 0)
+    return false;
+
+  bool ok = true;
+  for(uint32_t i = 0; ok && i < BLOCKS_PER_PAGE; i++){
+    char *data = frame + i * BLOCK_SIZE;
+    memset(b, 0, sizeof(*b));
+    b->dev = dev;
+    b->block_no = pgno * BLOCKS_PER_PAGE + i;
+    if(write){
+      memmove(b->data, data, BLOCK_SIZE);
+      b->flags = BLOCK_DIRTY;
+    }
+    if((ok = ide_rw(b)) && !write)
+      memmove(data, b->data, BLOCK_SIZE);
+  }
+
+  kmfree(b);
+  return ok;
+}
+
+// Drop pages mapped nowhere, i.e. only referenced by the cache, until below
+// PAGECACHE_MAX. Must hold pcache.lock.
+static void
+pagecache_evict(void)
+{
+  for(uint32_t i = 0; i < PAGECACHE_NHASH && pcache.count >= PAGECACHE_MAX; i++){
+    struct page **pp = &pcache.hash[i];
+    while(*pp && pcache.count >= PAGECACHE_MAX){
+      struct page *pg = *pp;
+      if(frame_info(V2P(pg->frame))->ref != 1){
+        pp = &pg->next;
+        continue;
+      }
+      *pp = pg->next;
+      kref_put(pg->frame);
+      kmem_cache_free(pcache.pages, pg);
+      pcache.count--;
+      pcache.evictions++;
+    }
+  }
+}
+
+// Fill frame with a page: len bytes copied from src for PAGECACHE_IMAGE, the
+// rest zeroed, or read from the device.
+static bool
+pagecache_fill(uint32_t dev, uint32_t pgno, const char *src, uint32_t len,
+               char *frame)
+{
+  if(dev != PAGECACHE_IMAGE)
+    return pagecache_io(dev, pgno, frame, false);
+  memmove(frame, src, len);
+  memset(frame + len, 0, PGSIZE - len);
+  return true;
+}
+
+// Drop pg from its hash chain. Must hold pcache.lock.
+static void
+pagecache_unlink(struct page *pg)
+{
+  struct page **pp = pagecache_bucket(pg->dev, pg->pgno);
+  while(*pp != pg)
+    pp = &(*pp)->next;
+  *pp = pg->next;
+  pcache.count--;
+}
+
+// Pages are filled without pcache.lock, so that disk reads don't hold up
+// other cpus: meanwhile the page is in the cache, flagged busy, and others
+// wanting it give up the cpu until it's ready. A failed read drops it.
+static char *
+pagecache_get_fill(uint32_t dev, uint32_t pgno, const char *src, uint32_t len)
+{
+  struct page *pg;
+  char *frame = 0;
+
+  acquire(&pcache.lock);
+  while((pg = pagecache_lookup(dev, pgno)) != 0 && pg->busy){
+    release(&pcache.lock);
+    if(myproc())
+      yield();
+    else
+      pause();
+    acquire(&pcache.lock);
+  }
+  if(pg){
+    pcache.hits++;
+    frame = pg->frame;
+    kref_get(frame);
+    goto out;
+  }
+
+  pcache.misses++;
+  if(pcache.count >= PAGECACHE_MAX)
+    pagecache_evict();
+
+  if((pg = kmem_cache_alloc(pcache.pages)) == 0)
+    goto out;
+  if((frame = kalloc()) == 0){
+    kmem_cache_free(pcache.pages, pg);
+    goto out;
+  }
+  frame_info(V2P(frame))->ref = 2;  // the cache's and the caller's
+
+  pg->dev = dev;
+  pg->pgno = pgno;
+  pg->frame = frame;
+  pg->busy = true;
+  struct page **bucket = pagecache_bucket(dev, pgno);
+  pg->next = *bucket;
+  *bucket = pg;
+  pcache.count++;
+  release(&pcache.lock);
+
+  bool ok = pagecache_fill(dev, pgno, src, len, frame);
+
+  acquire(&pcache.lock);
+  pg->busy = false;
+  if(!ok){
+    pagecache_unlink(pg);
+    kmem_cache_free(pcache.pages, pg);
+    frame_info(V2P(frame))->ref = 0;
+    kfree(frame);
+    frame = 0;
+  }
+
+ out:
+  release(&pcache.lock);
+  return frame;
+}
+
+// Frame holding page pgno of device dev, read on first use. A reference is
+// taken for the caller, to be dropped with kref_put(). Returns 0 on memory
+// or disk errors.
+char *
+pagecache_get(uint32_t dev, uint32_t pgno)
+{
+  return pagecache_get_fill(dev, pgno, 0, 0);
+}
+
+// Frame holding the read-only image page at src, of len bytes, copied on
+// first use. The page is keyed by src, so that every process running the
+// image maps the same frame. A reference is taken for the caller.
+char *
+pagecache_get_image(const char *src, uint32_t len)
+{
+  return pagecache_get_fill(PAGECACHE_IMAGE, (uint32_t)src, src, len);
+}
+
+// Frame holding page pgno of dev if already cached, with a reference taken
+// for the caller, or 0. Never reads the disk.
+char *
+pagecache_peek(uint32_t dev, uint32_t pgno)
+{
+  char *frame = 0;
+
+  acquire(&pcache.lock);
+  struct page *pg = pagecache_lookup(dev, pgno);
+  if(pg && !pg->busy){
+    pcache.hits++;
+    frame = pg->frame;
+    kref_get(frame);
+  }
+  release(&pcache.lock);
+  return frame;
+}
+
+// Write page pgno of dev back to disk, e.g. once modified through a shared
+// mapping. The frame is held, not the lock, while writing. A page still being
+// read can't have been modified.
+void
+pagecache_sync(uint32_t dev, uint32_t pgno)
+{
+  char *frame = 0;
+
+  acquire(&pcache.lock);
+  struct page *pg = pagecache_lookup(dev, pgno);
+  if(pg && !pg->busy){
+    frame = pg->frame;
+    kref_get(frame);
+  }
+  release(&pcache.lock);
+  if(frame == 0)
+    return;
+
+  if(!pagecache_io(dev, pgno, frame, true))
+    warn("pagecache_sync: failed to write page %d of dev %d", pgno, dev);
+  kref_put(frame);
+}
+
+void pagecache_dump(void) {
+    cprintf("page cache: pages=%d hits=%d misses=%d evictions=%d\n",
+            pcache.count, pcache.hits, pcache.misses, pcache.evictions);
+}
+
+void pagecache_init(void) {
+    initlock(&pcache.lock, "pagecache");
+    pcache.pages = kmem_cache_create("page", sizeof(struct page), 0, 0, 0);
+    if(pcache.pages == 0)
+        panic("pagecache_init");
+}
@@ -0,0 +1,27 @@
+/**
+ * Page cache: frames holding pages of block devices, shared by all mappings
+ * of a given device page (see mmap()). The cache holds its own reference on
+ * each frame, so pages survive their mappings until room is needed.
+ *
+ * Read-only pages of the program images embedded in the kernel are cached
+ * the same way, under the pseudo device PAGECACHE_IMAGE.
+ */
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stdint.h>
+
+#define PAGECACHE_NHASH 64
+/** Cached pages above which unmapped ones get dropped. */
+#define PAGECACHE_MAX   256
+/** Device of image pages, whose page number is their address in the image. */
+#define PAGECACHE_IMAGE 0xFFFFFFFF
+
+void pagecache_init(void);
+char *pagecache_get(uint32_t dev, uint32_t pgno);
+char *pagecache_get_image(const char *src, uint32_t len);
+char *pagecache_peek(uint32_t dev, uint32_t pgno);
+void pagecache_sync(uint32_t dev, uint32_t pgno);
+void pagecache_dump(void);
+
+#endif /* PAGECACHE_H */
@@ -1,23 +1,45 @@
 #include "drivers/acpi.h"
+#include "drivers/lapic.h"
 #include "drivers/screen.h"
 #include "lib/debug.h"
 #include "lib/string.h"
 #include "lib/utils.h"
+#include "cpu.h"
 #include "idt.h"
 #include "kalloc.h"
+#include "low_level.h"
 #include "pmem.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "swap.h"
+#include "vma.h"
+#include "vmalloc.h"
 
 #include "paging.h"
 
 /** kernel's identity-mapping page directory. */
 pde_t *kpgdir;    /** Allocated at paging init. */
 
+/**
+ * PTE_G when the CPU supports global pages. Added to all kernel half
+ * mappings, so that their TLB entries survive page directory switches.
+ */
+uint32_t kpte_global = 0;
+
+struct tlb_stats tlb_stats;
+
+/** Number of tlb_shootdown() calls so far, see cpu.tlb_gen. */
+static volatile uint32_t tlb_gen;
+
 
 // Return the address of the PTE in page table pgdir
 // that corresponds to virtual address va. If alloc!=0,
 // create any required page table pages.
+//
+// If va is covered by a large page, the page directory entry itself is
+// returned: callers can tell it apart by its PTE_PS bit.
 /* Lifted from https://github.com/mit-pdos/xv6-public/blob/master/vm.c */
-static pte_t *
+pte_t *
 walkpgdir(pde_t *pgdir, const uint32_t va, bool alloc)
 {
     pde_t *pde;
@@ -25,13 +47,14 @@ walkpgdir(pde_t *pgdir, const uint32_t va, bool alloc)
 
     pde = &pgdir[PDX(va)];
 
-    if(*pde & PTE_P){
+    if((*pde & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS)){
+        return (pte_t*)pde;
+    } else if(*pde & PTE_P){
         pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
     } else {
-        if(!alloc || (pgtab = (pte_t*)kalloc()) == 0)
-            return 0;
         // Make sure all those PTE_P bits are zero.
-        memset(pgtab, 0, PGSIZE);
+        if(!alloc || (pgtab = (pte_t*)kalloc_zeroed()) == 0)
+            return 0;
         // The permissions here are overly generous, but they can
         // be further restricted by the permissions in the page table
         // entries, if necessary.
@@ -46,13 +69,15 @@ walkpgdir(pde_t *pgdir, const uint32_t va, bool alloc)
 uint32_t paging_get_paddr(uint32_t vaddr) {
     pte_t *pte = walkpgdir(kpgdir, vaddr, false);
     assert(pte != NULL);
-    return *pte + ADDR_PAGE_OFFSET(vaddr);
+    if(*pte & PTE_PS)
+        return PDE_HADDR(*pte) + (vaddr & (HPGSIZE-1));
+    return PTE_ADDR(*pte) + ADDR_PAGE_OFFSET(vaddr);
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int
+int
 mappages(pde_t *pgdir, uintptr_t va, uint32_t size, uint32_t pa, int perm)
 {
   char *a, *last;
@@ -78,6 +103,34 @@ mappages(pde_t *pgdir, uintptr_t va, uint32_t size, uint32_t pa, int perm)
   return 0;
 }
 
+// Same as mappages() but use large pages wherever both va and pa are aligned
+// on HPGSIZE and the remaining size allows it. Only the unaligned edges of the
+// region get 4KiB pages. Meant for the kernel half of the address space.
+static int
+kmappages(pde_t *pgdir, uintptr_t va, uint32_t size, uint32_t pa, int perm)
+{
+  uint32_t a = PGROUNDDOWN(va);
+  uint32_t end = PGROUNDUP(va + size);  // 0 if the region reaches 4GiB
+  pa = PGROUNDDOWN(pa);
+
+  while(a != end){
+    if(a % HPGSIZE == 0 && pa % HPGSIZE == 0 && end - a >= HPGSIZE){
+      pde_t *pde = &pgdir[PDX(a)];
+      if(*pde & PTE_P)
+        panic("remap");
+      *pde = pa | perm | PTE_PS | PTE_P;
+      a += HPGSIZE;
+      pa += HPGSIZE;
+    } else {
+      if(mappages(pgdir, a, PGSIZE, pa, perm) < 0)
+        return -1;
+      a += PGSIZE;
+      pa += PGSIZE;
+    }
+  }
+  return 0;
+}
+
 /** Page fault (ISR # 14) handler. */
 static void page_fault_handler(struct interrupt_state *state) {
     /** The CR2 register holds the faulty address. */
@@ -97,7 +150,20 @@ static void page_fault_handler(struct interrupt_state *state) {
     bool write   = state->err_code & 1<<1;
     bool user    = state->err_code & 1<<2;
 
-    /** Just prints an information message for now. */
+    /**
+     * User pages are mapped on first touch and copied on first write after
+     * fork(), see vma_fault(). The kernel may fault them in too, when
+     * accessing system call arguments (CR0_WP makes it honor read-only user
+     * pages).
+     */
+    if(!user && vmalloc_fault(faulty_addr) == 0)
+        return;
+
+    struct process *p = myproc();
+    if(p != NULL && faulty_addr < KERNBASE &&
+       vma_fault(p, faulty_addr, write, present) == 0)
+        return;
+
     warn("Caught page fault {\n"
          "  faulty addr = 0x%p\n"
          "  present: %d\n"
@@ -105,34 +171,150 @@ static void page_fault_handler(struct interrupt_state *state) {
          "  user:    %d\n"
          "}", faulty_addr, present, write, user);
 
+    if(user && p != NULL){
+        warn("killing process %d (%s)", p->pid, p->name);
+        exit(-1);
+    }
+
     panic("page fault not handled!");
 }
 
 /** Switch the current page directory to the given one. */
 inline void paging_switch_pgdir(const pde_t *pgdir) {
     assert(pgdir != NULL);
-    __asm__ __volatile__ ( "movl %0, %%cr3" : : "r" (pgdir) );
+    tlb_stats.cr3_loads++;
+    __asm__ __volatile__ ( "movl %0, %%cr3" : : "r" (pgdir) : "memory" );
 }
 
-// Load the initcode into address 0 of pgdir.
-// sz must be less than a page.
-void
-inituvm(pde_t *pgdir, char *init, size_t sz)
-{
-  if(sz >= PGSIZE)
-    panic("inituvm: more than a page");
-  char *mem = kalloc();
-  memset(mem, 0, PGSIZE);
-  // process virtual address space starts at 0x0.
-  mappages(pgdir, 0, PGSIZE, V2P(mem), PTE_W|PTE_U);
-  // We could use memcpy() instead of memmove() as I can't imagine any cases
-  // where the newly allocated page would overlap with the init code.
-  //
-  // One reason to actually copy and not just map is that the init code doesn't
-  // reside on a page boundary.
-  memmove(mem, init, sz);
+/**
+ * Invalidate the TLB entry for the page located at the given virtual
+ * address. Works for global pages too. See Intel x86 vol 3 section 3.7.
+ */
+void tlb_flush_page(uint32_t vaddr) {
+    tlb_stats.page_flushes++;
+    invlpg(vaddr);
 }
 
+/**
+ * Invalidate the whole TLB. Reloading CR3 keeps global entries, so with
+ * global pages we toggle CR4_PGE instead, which flushes everything.
+ */
+void tlb_flush_all(void) {
+    tlb_stats.full_flushes++;
+    if(kpte_global){
+        uint32_t cr4 = rcr4();
+        lcr4(cr4 & ~CR4_PGE);
+        lcr4(cr4);
+    } else {
+        uint32_t cr3;
+        __asm__ __volatile__ ( "movl %%cr3, %0\n\tmovl %0, %%cr3"
+                               : "=r" (cr3) : : "memory" );
+    }
+}
+
+/**
+ * Other cpus may keep pgdir loaded after running its process, see
+ * scheduler(). Have them reload it, should they run the process again.
+ * Nobody runs it but us: it's ours, or pinned off its run queue, see
+ * process_pin().
+ */
+static void tlb_forget_pgdir(pde_t *pgdir) {
+    pushcli();
+    struct cpu *me = mycpu();
+    for(struct cpu *c = cpus; c < cpus + ncpu; c++)
+        if(c != me && c->pgdir == pgdir)
+            c->pgdir_stale = true;
+    popcli();
+}
+
+/**
+ * Invalidate the TLB entries of a user address space whose page tables just
+ * changed, if it is loaded on this cpu. Kernel (global) entries are kept.
+ */
+void tlb_flush_pgdir(pde_t *pgdir) {
+    pushcli();
+    tlb_forget_pgdir(pgdir);
+    if(mycpu()->pgdir == pgdir)
+        paging_switch_pgdir((pde_t*)V2P(pgdir));
+    popcli();
+}
+
+/**
+ * Flush this cpu's TLB if a tlb_shootdown() happened since the last time.
+ * Also polled by cpus spinning with interrupts disabled, which can't take
+ * the IPI.
+ */
+void tlb_catch_up(void) {
+    pushcli();
+    struct cpu *c = mycpu();
+    uint32_t gen = tlb_gen;
+    if(c->tlb_gen != gen){
+        tlb_flush_all();
+        c->tlb_gen = gen;
+    }
+    popcli();
+}
+
+static void tlb_ipi_handler(struct interrupt_state *state) {
+    (void) state;   /** Unused. */
+
+    tlb_catch_up();
+    lapic_eoi();
+}
+
+/**
+ * Invalidate the whole TLB of every cpu, after kernel mappings went away.
+ * Other cpus get an IPI, and we wait until they all flushed.
+ */
+void tlb_shootdown(void) {
+    pushcli();
+    uint32_t gen = __sync_add_and_fetch(&tlb_gen, 1);
+    tlb_catch_up();
+    if(ncpu > 1){
+        lapic_ipi_others(IDT_IPI_TLB);
+        for(struct cpu *c = cpus; c < cpus + ncpu; c++)
+            while(c->started && (int32_t)(c->tlb_gen - gen) < 0){
+                tlb_catch_up();     // another cpu may be waiting for us
+                pause();
+            }
+    }
+    popcli();
+}
+
+void tlb_dump_stats(void) {
+    cprintf("TLB: cr3 loads=%d, full flushes=%d, page flushes=%d\n",
+            tlb_stats.cr3_loads, tlb_stats.full_flushes,
+            tlb_stats.page_flushes);
+}
+
+// Break the user huge page covering va into 4KiB pages, e.g. to unmap or
+// share part of it. Its frames become independent ones. Returns -1 if out of
+// memory for the page table.
+int
+hugepage_split(pde_t *pgdir, uint32_t va)
+{
+  pde_t *pde = &pgdir[PDX(va)];
+  if((*pde & (PTE_P|PTE_PS)) != (PTE_P|PTE_PS))
+    return 0;
+  if(va >= KERNBASE)
+    panic("hugepage_split: kernel");
+
+  pte_t *pgtab = (pte_t*)kalloc();
+  if(pgtab == 0)
+    return -1;
+
+  uint32_t pa = PDE_HADDR(*pde);
+  uint32_t flags = PTE_FLAGS(*pde) & ~PTE_PS;
+  if(frame_info(pa)->ref != 1)
+    panic("hugepage_split: shared");
+  for(uint32_t i = 0; i < NPTENTRIES; i++){
+    pgtab[i] = (pa + i * PGSIZE) | flags;
+    frame_info(pa + i * PGSIZE)->ref = 1;
+  }
+  *pde = V2P(pgtab) | PTE_P | PTE_W | PTE_U;
+  tlb_flush_pgdir(pgdir);
+  return 0;
+}
 
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
@@ -152,12 +334,27 @@ deallocuvm(pde_t *pgdir, uint32_t oldsz, uint32_t newsz)
     pte = walkpgdir(pgdir, a, 0);
     if(!pte) // pde not present
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
-    else if(*pte & PTE_P){
+    else if(*pte & PTE_PS){
+      if(a % HPGSIZE == 0 && a + HPGSIZE <= oldsz){
+        // Whole huge page.
+        kref_put_pages(P2V(PDE_HADDR(*pte)), HPGORDER);
+        *pte = 0;
+        a += HPGSIZE - PGSIZE;
+      } else {
+        // Part of it: go on with its 4KiB pages.
+        if(hugepage_split(pgdir, a) < 0)
+          panic("deallocuvm: out of memory");
+        a -= PGSIZE;
+      }
+    } else if(*pte & PTE_P){
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
       char *v = P2V(pa);
-      kfree(v);
+      kref_put(v);  // may be shared copy-on-write
+      *pte = 0;
+    } else if(*pte & PTE_SWAP){
+      swap_free(*pte);
       *pte = 0;
     }
   }
@@ -172,13 +369,21 @@ freevm(pde_t *pgdir)
   if(pgdir == 0)
       panic("freevm: no pgdir");
 
+  // The scheduler may still run on it (lazy TLB).
+  pushcli();
+  if(mycpu()->pgdir == pgdir)
+    switchkvm();
+  popcli();
+
   // Frames to be freed: page directory, page tables, user process code. But
   // user code is only referenced/reachable by virtual address 0x (and up),
   // hence deallocuvm().
   deallocuvm(pgdir, KERNBASE, 0);
 
-  for(uint32_t i = 0; i < NPDENTRIES; i++){
-    if(pgdir[i] & PTE_P){
+  // Page tables of the kernel half are shared with kpgdir and every other
+  // address space: only free the user ones.
+  for(uint32_t i = 0; i < PDX(KERNBASE); i++){
+    if((pgdir[i] & (PTE_P|PTE_PS)) == PTE_P){
       char * pte = P2V(PTE_ADDR(pgdir[i]));
       kfree(pte);
     }
@@ -187,59 +392,232 @@ freevm(pde_t *pgdir)
   kfree((char*)pgdir);
 }
 
-// Allocate a page table and initialize its kernel part.
+// Create a copy of pgdir's user half for a child process. No data is copied:
+// frames are shared copy-on-write. Writable pages lose PTE_W in both address
+// spaces and get PTE_COW instead, the first write to them is resolved by
+// cowpage(). Shared mappings (PTE_SHARED) stay shared. Returns 0 on failure.
 pde_t*
-setupkvm(void)
+copyuvm(pde_t *pgdir)
 {
-    pde_t *pgdir;
+  pde_t *d;
+
+  if((d = setupkvm()) == 0)
+    return 0;
+
+  for(uint32_t i = 0; i < PDX(KERNBASE); i++){
+    if(!(pgdir[i] & PTE_P))
+      continue;
+    // Huge pages are shared copy-on-write as 4KiB pages.
+    if((pgdir[i] & PTE_PS) && hugepage_split(pgdir, PGADDR(i, 0, 0)) < 0)
+      goto bad;
+    pte_t *pgtab = (pte_t*)P2V(PTE_ADDR(pgdir[i]));
+    for(uint32_t j = 0; j < NPTENTRIES; j++){
+      pte_t *pte = &pgtab[j];
+      if(*pte & PTE_SWAP){
+        // Both refer to the slot, each gets its own copy when swapped in.
+        pte_t *dpte = walkpgdir(d, PGADDR(i, j, 0), true);
+        if(dpte == 0)
+          goto bad;
+        *dpte = *pte;
+        swap_dup(*pte);
+        continue;
+      }
+      if(!(*pte & PTE_P))
+        continue;
+      if((*pte & (PTE_W|PTE_SHARED)) == PTE_W)
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      uint32_t pa = PTE_ADDR(*pte);
+      if(mappages(d, PGADDR(i, j, 0), PGSIZE, pa,
+                  PTE_FLAGS(*pte) & (PTE_U|PTE_W|PTE_COW|PTE_SHARED)) < 0)
+        goto bad;
+      kref_get(P2V(pa));
+    }
+  }
+
+  // Our own write permissions just went away.
+  tlb_flush_pgdir(pgdir);
+
+  return d;
+
+bad:
+  freevm(d);
+  return 0;
+}
+
+// Resolve a write to the copy-on-write page at va: the writer gets its own
+// copy, unless it is the last one sharing the frame, which is then simply
+// made writable again. Returns -1 if va isn't copy-on-write.
+int
+cowpage(pde_t *pgdir, uint32_t va)
+{
+  pte_t *pte = walkpgdir(pgdir, va, false);
+  if(pte == 0 || (*pte & (PTE_P|PTE_PS|PTE_COW)) != (PTE_P|PTE_COW))
+    return -1;
+
+  uint32_t pa = PTE_ADDR(*pte);
+  uint32_t flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(frame_info(pa)->ref == 1){
+    *pte = pa | flags;
+  } else {
+    char *mem = kalloc();
+    if(mem == 0)
+      return -1;
+    memmove(mem, P2V(pa), PGSIZE);
+    frame_info(V2P(mem))->ref = 1;
+    *pte = V2P(mem) | flags;
+    kref_put(P2V(pa));
+  }
+  tlb_flush_page(PGROUNDDOWN(va));
+  tlb_forget_pgdir(pgdir);
+  return 0;
+}
+
+// Map user virtual address to kernel address.
+static char*
+uva2ka(pde_t *pgdir, uint32_t uva)
+{
+  pte_t *pte = walkpgdir(pgdir, uva, false);
+  if(pte == 0)
+    return 0;
+  if((*pte & PTE_P) == 0)
+    return 0;
+  if((*pte & PTE_U) == 0)
+    return 0;
+  if(*pte & PTE_PS)
+    return (char*)P2V(PDE_HADDR(*pte) + (PGROUNDDOWN(uva) & (HPGSIZE-1)));
+  return (char*)P2V(PTE_ADDR(*pte));
+}
+
+// Copy len bytes from p to user address va in page table pgdir, which needs
+// not be the current one. Pages must already be mapped: most useful to
+// set up a new address space.
+int
+copyout(pde_t *pgdir, uint32_t va, const void *p, uint32_t len)
+{
+  const char *buf = (const char*)p;
+  while(len > 0){
+    uint32_t va0 = PGROUNDDOWN(va);
+    char *pa0 = uva2ka(pgdir, va0);
+    if(pa0 == 0)
+      return -1;
+    uint32_t n = PGSIZE - (va - va0);
+    if(n > len)
+      n = len;
+    memmove(pa0 + (va - va0), buf, n);
+    len -= n;
+    buf += n;
+    va = va0 + PGSIZE;
+  }
+  return 0;
+}
 
+/**
+ * Build the kernel half of the address space into kpgdir. This is done only
+ * once: every other page directory links to the resulting page tables.
+ */
+static void
+kvm_init(void)
+{
     /**
      * Allocate the one-page space for the kernel's page directory in
      * the kernel heap. All pages of page directory/tables must be
      * page-aligned.
      */
-    if((pgdir = (pde_t*)kalloc()) == 0)
+    if((kpgdir = (pde_t*)kalloc_zeroed()) == 0)
         panic("kalloc");
-    memset(pgdir, 0, PGSIZE);
 
     /**
-     * Map all physical memory to the kernel's virtual address space.
+     * Map all physical memory to the kernel's virtual address space. Large
+     * pages (CR4_PSE is turned on in kernel_entry.asm) spare us most of the
+     * page tables and TLB entries of the direct map.
      *
      * See also xv6 kernel's mappings:
      * https://github.com/mit-pdos/xv6-public/blob/eeb7b415dbcb12cc362d0783e41c3d1f44066b17/vm.c#L105
      */
-    if(mappages(pgdir, KERNBASE, phys_end - 0, 0, PTE_W) < 0)
-        goto mapfail;
+    if(kmappages(kpgdir, KERNBASE, phys_end - 0, 0, PTE_W|kpte_global) < 0)
+        panic("mappages");
 
     // For ACPI. The should not be any overlap with kernel space. Size
     // arbitrarily set to the whole space until virtual start of virtual kernel
-    // space.
-    if(mappages(pgdir, (uintptr_t)P2V(acpi), acpi_len, acpi, PTE_W) < 0)
-        goto mapfail;
+    // space. Tables lying in RAM holes are already part of the direct map.
+    if(acpi + acpi_len > phys_end){
+        uint32_t start = acpi < phys_end ? phys_end : acpi;
+        if(kmappages(kpgdir, (uintptr_t)P2V(start), acpi + acpi_len - start,
+                     start, PTE_W|kpte_global) < 0)
+            panic("mappages");
+    }
 
     // For IOAPIC. FIXME why if 0xfec00000 not in the pmem tables???
-    if(mappages(pgdir, DEVSPACE, 0xf00000, DEVSPACE, PTE_W) < 0)
-        goto mapfail;
+    if(kmappages(kpgdir, DEVSPACE, 0xf00000, DEVSPACE, PTE_W|kpte_global) < 0)
+        panic("mappages");
+}
 
-    return pgdir;
+// Allocate a page table and initialize its kernel part.
+//
+// The kernel half is not rebuilt: its page directory entries are copied from
+// kpgdir, so all address spaces share the same kernel page tables and
+// creating one costs a single page whatever the amount of RAM.
+pde_t*
+setupkvm(void)
+{
+    pde_t *pgdir;
+
+    if((pgdir = (pde_t*)kalloc_zeroed()) == 0)
+        return 0;
+    memmove(&pgdir[PDX(KERNBASE)], &kpgdir[PDX(KERNBASE)],
+            (NPDENTRIES - PDX(KERNBASE)) * sizeof(pde_t));
 
-  mapfail:
-    freevm(pgdir);
-    panic("mappages");
+    return pgdir;
 }
 
 
+/**
+ * Turn on global pages if the CPU supports them. Kernel mappings are then
+ * created with PTE_G and are not flushed by the CR3 reloads of context
+ * switches.
+ */
+static void
+pge_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if(!(edx & CPUID_FEAT_EDX_PGE)){
+        warn("paging: global pages not supported");
+        return;
+    }
+
+    lcr4(rcr4() | CR4_PGE);
+    kpte_global = PTE_G;
+}
+
 /** Initialize paging and switch to use paging. */
 void paging_init()
 {
-    kpgdir = setupkvm();
+    pge_init();
+    kvm_init();
 
     /**
      * Register the page fault handler. This action must be done before
      * we do the acatual switch towards using paging.
      */
     isr_register(IDT_INT_PGFLT, &page_fault_handler);
+    isr_register(IDT_IPI_TLB, &tlb_ipi_handler);
 
     /** Load the address of kernel page directory into CR3. */
     paging_switch_pgdir((pde_t*)V2P(kpgdir));
 }
+
+/**
+ * Move an application processor from entrypgdir to the kernel page
+ * directory, with the boot processor's paging features.
+ */
+void paging_init_ap(void)
+{
+    if(kpte_global)
+        lcr4(rcr4() | CR4_PGE);
+    paging_switch_pgdir((pde_t*)V2P(kpgdir));
+
+    struct cpu *c = mycpu();
+    c->pgdir = kpgdir;
+    c->tlb_gen = tlb_gen;   // nothing cached from before
+}
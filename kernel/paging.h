@@ -37,19 +37,36 @@
 #define PGROUNDUP(sz)  (((uint32_t)(sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((uint32_t)(a)) & ~(PGSIZE-1))
 
+// Large pages (PSE): a single page directory entry maps 4MiB.
+#define HPGSIZE         (1 << PDXSHIFT)  // bytes mapped by a large page
+#define HPGORDER        (PDXSHIFT - PTXSHIFT)  // buddy order of a large page
+
+#define HPGROUNDUP(sz)  (((uint32_t)(sz)+HPGSIZE-1) & ~(HPGSIZE-1))
+#define HPGROUNDDOWN(a) (((uint32_t)(a)) & ~(HPGSIZE-1))
+
 // Page table/directory entry flags.
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
+#define PTE_A           0x020   // Accessed
+#define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
+#define PTE_G           0x100   // Global, survives CR3 reloads (CR4_PGE)
+#define PTE_COW         0x200   // Copy-on-write, available to software
+#define PTE_SHARED      0x400   // Shared mapping, kept writable by fork()
+#define PTE_SWAP        0x800   // Not present, swapped out, see swap.h
 
 // Extract address from page table or page directory entry
 #define PTE_ADDR(pte)   ((uint32_t)(pte) & ~0xFFF)
 #define PTE_FLAGS(pte)  ((uint32_t)(pte) &  0xFFF)
+// Extract address from a large (PTE_PS) page directory entry
+#define PDE_HADDR(pde)  ((uint32_t)(pde) & ~(HPGSIZE-1))
 
 
 #define KERNLINK (KERNBASE+EXTMEM)  // Address where kernel is linked
 #define DEVSPACE 0xFE000000         // Other devices are at high addresses
+#define VMALLOC_START 0xF0000000    // vmalloc() region, see vmalloc.h
+#define VMALLOC_END   DEVSPACE
 
 #define V2P(a) (((uintptr_t) (a)) - KERNBASE)
 #define P2V(a) ((void *)(((uintptr_t) (a)) + KERNBASE))
@@ -64,18 +81,32 @@
         __asm__ __volatile__("invlpg %0"::"m"(*((unsigned *)(vaddr)))); \
     } while(0)
 
+/** Physical address of the loaded page directory. */
+static inline uint32_t rcr3(void) {
+    uint32_t val;
+    __asm__ __volatile__ ( "movl %%cr3, %0" : "=r" (val) );
+    return val;
+}
 
-/**
- * Helper macro to control the MMU: invalidate the whole TLB. See
- * Intel x86 vol 3 section 3.7.
- */
-#define flush_tlb()                                                 \
-    do {                                                            \
-        unsigned long tmpreg;                                       \
-        __asm__ __volatile__("movl %%cr3,%0\n\tmovl %0,%%cr3" :"=r" \
-                             (tmpreg) : :"memory");                 \
-    } while (0)
+/** Control register 4 accessors, see CR4_* in paging_defs.asm. */
+static inline uint32_t rcr4(void) {
+    uint32_t val;
+    __asm__ __volatile__ ( "movl %%cr4, %0" : "=r" (val) );
+    return val;
+}
 
+static inline void lcr4(uint32_t val) {
+    __asm__ __volatile__ ( "movl %0, %%cr4" : : "r" (val) : "memory" );
+}
+
+/** TLB maintenance counters, to measure the cost of address space switches. */
+struct tlb_stats {
+    uint32_t cr3_loads;     /** Page directory switches (non-global flush). */
+    uint32_t full_flushes;  /** Explicit whole TLB flushes, global included. */
+    uint32_t page_flushes;  /** Single page invalidations. */
+};
+
+extern struct tlb_stats tlb_stats;
 
 
 /**
@@ -89,14 +120,30 @@ typedef uint32_t pte_t;
 
 /** Extern the kernel page directory pointer to the scheduler. */
 extern pde_t *kpgdir;
+extern uint32_t kpte_global;
 
 uint32_t paging_get_paddr(uint32_t vaddr);
 
 void paging_switch_pgdir(const pde_t *pgdir);
 
+void tlb_flush_page(uint32_t vaddr);
+void tlb_flush_all(void);
+void tlb_flush_pgdir(pde_t *pgdir);
+void tlb_catch_up(void);
+void tlb_shootdown(void);
+void tlb_dump_stats(void);
+
+pte_t *walkpgdir(pde_t *pgdir, const uint32_t va, bool alloc);
+int mappages(pde_t *pgdir, uintptr_t va, uint32_t size, uint32_t pa, int perm);
 pde_t* setupkvm(void);
-void inituvm(pde_t *pgdir, char *init, size_t sz);
+pde_t* copyuvm(pde_t *pgdir);
+int cowpage(pde_t *pgdir, uint32_t va);
+int hugepage_split(pde_t *pgdir, uint32_t va);
+uint32_t deallocuvm(pde_t *pgdir, uint32_t oldsz, uint32_t newsz);
+void freevm(pde_t *pgdir);
+int copyout(pde_t *pgdir, uint32_t va, const void *p, uint32_t len);
 
 void paging_init();
+void paging_init_ap(void);
 
 #endif /* PAGING_H */
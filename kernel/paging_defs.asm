@@ -6,3 +6,4 @@
 %define CR0_WP   0x00010000      ; Write Protect
 %define CR0_PG   0x80000000      ; Paging
 %define CR4_PSE  0x00000010      ; Page size extension
+%define CR4_PGE  0x00000080      ; Page global enable
@@ -1,17 +1,60 @@
 #include "drivers/acpi.h"
 #include "drivers/screen.h"
 #include "lib/string.h"
+#include "kalloc.h"
+#include "paging.h"
 
 #include "pmem.h"
 
 /* Well-known memory regions */
 #define PMEM_EXTENDED_ADDR 0x100000 // aka "high mem"
 
-/** Bitmap tracking used frames. */
-static uint32_t *frame_map = NULL;
+/**
+ * Bitmap tracking frames that can't be given to the frame allocator: holes,
+ * reserved and firmware areas, and low memory which we leave to the BIOS.
+ * A set bit means unusable.
+ */
+static uint32_t frame_map[PMEM_MAX_ADDR / PGSIZE / 32];
+
+/** Usable regions from the e820 memory map. */
+static struct pmem_region regions[PMEM_MAX_REGIONS];
+static int nregions = 0;
 
 uintptr_t phys_end = 0;
 
+static void frame_map_set(uint32_t base, uint32_t end, bool unusable) {
+    for (uint32_t f = PGROUNDUP(base) / PGSIZE; f < end / PGSIZE; f++) {
+        if (unusable)
+            frame_map[f / 32] |= 1 << (f % 32);
+        else
+            frame_map[f / 32] &= ~(1 << (f % 32));
+    }
+}
+
+bool pmem_usable(uint32_t paddr) {
+    uint32_t f = paddr / PGSIZE;
+    return paddr < phys_end && !(frame_map[f / 32] & (1 << (f % 32)));
+}
+
+/** Whether all frames in [base, end) are usable. Checks 32 frames at once. */
+bool pmem_usable_range(uint32_t base, uint32_t end) {
+    if (end > phys_end)
+        return false;
+    uint32_t f = base / PGSIZE, last = end / PGSIZE;
+    while (f < last) {
+        if (f % 32 == 0 && last - f >= 32) {
+            if (frame_map[f / 32])
+                return false;
+            f += 32;
+        } else {
+            if (frame_map[f / 32] & (1 << (f % 32)))
+                return false;
+            f++;
+        }
+    }
+    return true;
+}
+
 /* Checks if A20 is enabled
  *
  * https://forum.osdev.org/viewtopic.php?p=276550#p276550
@@ -36,6 +79,8 @@ void pmem_init(const struct pmem_info *info) {
     if (!info || !info->cnt)
         panic("physical memory map not initialized");
 
+    memset(frame_map, 0xff, sizeof(frame_map));
+
     const struct e820_entry *extmem = NULL;
     print("BIOS-provided physical RAM map:\n");
     for (int i = 0; i < info->cnt; i++) {
@@ -49,6 +94,22 @@ void pmem_init(const struct pmem_info *info) {
             extmem = entry;
         }
 
+        // Record all RAM, and ACPI tables which we'll reclaim once parsed.
+        if ((entry->type == E820_TYPE_RAM || entry->type == E820_TYPE_ACPI) &&
+            entry->base < PMEM_MAX_ADDR && nregions < PMEM_MAX_REGIONS) {
+            uint64_t end = entry->base + entry->len;
+            struct pmem_region *r = &regions[nregions++];
+            r->base = entry->base;
+            r->end = end > PMEM_MAX_ADDR ? PMEM_MAX_ADDR : end;
+            r->type = entry->type;
+            // Low memory is left alone.
+            if (r->type == E820_TYPE_RAM && r->end > PMEM_EXTENDED_ADDR)
+                frame_map_set(r->base < PMEM_EXTENDED_ADDR ?
+                              PMEM_EXTENDED_ADDR : r->base, r->end, false);
+            if (r->end > phys_end)
+                phys_end = r->end;
+        }
+
         if (!acpi &&
             (entry->type == E820_TYPE_ACPI ||
              (extmem && entry->type == E820_TYPE_RESERVED))) {
@@ -65,7 +126,32 @@ void pmem_init(const struct pmem_info *info) {
     acpi = (uintptr_t)(((struct e820_entry *)acpi)->base);
     cprintf("ACPI Info: 0x%p, len=0x%x\n", acpi, acpi_len);
 
-    // For simplicity, our OS being 32-bit, we'll assume the size of the
-    // extended memory fits into an uint32_t.
-    phys_end = (uint32_t)(extmem->base + extmem->len);
+    // The direct map covers all recorded regions, holes included.
+    phys_end = PGROUNDDOWN(phys_end);
+}
+
+/**
+ * Give ACPI reclaimable memory to the frame allocator. Must be called after
+ * acpi_init() has parsed the tables living there.
+ */
+void pmem_reclaim_acpi(void) {
+    for (int i = 0; i < nregions; i++) {
+        struct pmem_region *r = &regions[i];
+        if (r->type != E820_TYPE_ACPI)
+            continue;
+        cprintf("pmem: reclaiming ACPI memory 0x%p-0x%p\n", r->base, r->end);
+        frame_map_set(r->base, r->end, false);
+        freerange(P2V(r->base), P2V(r->end));
+    }
+}
+
+/** Print usable regions with their number of free frames. */
+void pmem_dump(void) {
+    for (int i = 0; i < nregions; i++) {
+        struct pmem_region *r = &regions[i];
+        cprintf("pmem: region 0x%p-0x%p type=%d free frames=%d/%d\n",
+                r->base, r->end, r->type,
+                kalloc_count_free(r->base, r->end),
+                (r->end - PGROUNDUP(r->base)) / PGSIZE);
+    }
 }
@@ -29,9 +29,28 @@ struct pmem_info {
     struct e820_entry entries[];
 };
 
+#define PMEM_MAX_REGIONS 32
+
+/**
+ * Highest physical address we can use: the direct map of physical memory
+ * at KERNBASE must stop before the vmalloc() region, at VMALLOC_START.
+ */
+#define PMEM_MAX_ADDR 0x70000000
+
+/** Usable memory region, clipped to [0, PMEM_MAX_ADDR). */
+struct pmem_region {
+    uint32_t base;
+    uint32_t end;
+    uint32_t type;      /** E820_TYPE_RAM or E820_TYPE_ACPI (reclaimable) */
+};
+
 extern uint32_t phys_end;
 
 void pmem_init(const struct pmem_info *info);
+bool pmem_usable(uint32_t paddr);
+bool pmem_usable_range(uint32_t base, uint32_t end);
+void pmem_reclaim_acpi(void);
+void pmem_dump(void);
 
 
 #endif /* PMEM_H */
@@ -1,12 +1,18 @@
 #include "drivers/screen.h"
 #include "cpu.h"
+#include "elf.h"
 #include "gdt.h"
 #include "kalloc.h"
+#include "ksm.h"
+#include "low_level.h"
 #include "paging.h"
+#include "shm.h"
 #include "spinlock.h"
+#include "swap.h"
 #include "syscall.h"
 #include "lib/debug.h"
 #include "lib/string.h"
+#include "lib/utils.h"
 
 #include "proc.h"
 
@@ -32,6 +38,8 @@ static uint16_t nextpid = 1;
 
 void process_init() {
     initlock(&ptable.lock, "ptable");
+    for(struct cpu *c = cpus; c < cpus + ncpu; c++)
+        initlock(&c->rq.lock, "runqueue");
 
     // ptable and nextpid already initialized. Especially all processes are in
     // state UNUSED.
@@ -47,12 +55,126 @@ void process_init() {
 static void
 enter_process(void)
 {
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Interrupts still disabled by the scheduler, see enter_scheduler().
+  popcli();
 
   // Return to "caller", actually trapret (see allocproc).
 }
 
+// Run queues. Each cpu runs the processes of its own queue in turn, and only
+// takes the lock of another one to steal work when it has none. Must hold
+// rq->lock.
+
+static void
+rq_push(struct runqueue *rq, struct process *p)
+{
+  p->rqnext = 0;
+  p->rqprev = rq->tail;
+  if(rq->tail)
+    rq->tail->rqnext = p;
+  else
+    rq->head = p;
+  rq->tail = p;
+  rq->len++;
+  p->onrq = true;
+}
+
+static void
+rq_remove(struct runqueue *rq, struct process *p)
+{
+  if(p->rqprev)
+    p->rqprev->rqnext = p->rqnext;
+  else
+    rq->head = p->rqnext;
+  if(p->rqnext)
+    p->rqnext->rqprev = p->rqprev;
+  else
+    rq->tail = p->rqprev;
+  rq->len--;
+  p->onrq = false;
+}
+
+/**
+ * Make p RUNNABLE on cpu c's queue. Yielding processes go back to the cpu
+ * they ran on, whose caches may still hold their data, and new ones to their
+ * creator's cpu, where the pages they share with it are.
+ */
+static void
+runqueue_add(struct cpu *c, struct process *p)
+{
+  acquire(&c->rq.lock);
+  p->state = RUNNABLE;
+  p->cpu = c;
+  rq_push(&c->rq, p);
+  release(&c->rq.lock);
+}
+
+// Take the next process off victim's queue for c to run, or null.
+static struct process *
+runqueue_take(struct cpu *c, struct cpu *victim)
+{
+  struct runqueue *rq = &victim->rq;
+  acquire(&rq->lock);
+  struct process *p = rq->head;
+  if(p){
+    rq_remove(rq, p);
+    p->state = RUNNING;
+    p->cpu = c;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+/**
+ * Next process for cpu c to run: the head of its queue, or else the one
+ * waiting for the longest on the busiest other queue, hence the least likely
+ * to still be in that cpu's caches.
+ */
+static struct process *
+runqueue_pick(struct cpu *c)
+{
+  struct process *p;
+
+  if(c->rq.len && (p = runqueue_take(c, c)))
+    return p;
+
+  struct cpu *victim = 0;
+  uint32_t most = 0;
+  for(struct cpu *o = cpus; o < cpus + ncpu; o++){
+    if(o != c && o->rq.len > most){
+      most = o->rq.len;
+      victim = o;
+    }
+  }
+  return victim ? runqueue_take(c, victim) : 0;
+}
+
+// Let the new process p run, on our cpu.
+static void
+process_start(struct process *p)
+{
+  pushcli();
+  runqueue_add(mycpu(), p);
+  popcli();
+}
+
+/**
+ * Give p's slot back, with its kernel stack, which it mustn't be running on
+ * anymore. Must hold ptable.lock.
+ */
+static void
+process_free(struct process *p)
+{
+    if(p->kstack)
+        kfree((char*)p->kstack);
+    p->kstack = 0;
+    p->pid = 0;
+    p->parent = 0;
+    p->name[0] = 0;
+    p->cpu = 0;
+    p->state = UNUSED;
+}
+
 /**
  * Find an UNUSED slot in the ptable and put it into INITIAL state. If all
  * slots are in use, return NULL.
@@ -75,12 +197,20 @@ process_alloc(void)
   found:
     p->state = INITIAL;
     p->pid = nextpid++;
+    p->pgdir = 0;
+    memset(p->vmas, 0, sizeof(p->vmas));
+    memset(&p->hugestats, 0, sizeof(p->hugestats));
+    p->swaphand = 0;
+    p->ksmhand = 0;
+    p->cpu = 0;
 
     release(&ptable.lock);
 
     // Allocate kernel stack.
     if((p->kstack = (uint32_t)kalloc()) == 0){
-        p->state = UNUSED;
+        acquire(&ptable.lock);
+        process_free(p);
+        release(&ptable.lock);
         warn("new_process: failed to allocate kernel stack page");
         return NULL;
     }
@@ -111,6 +241,90 @@ process_alloc(void)
 }
 
 
+/** User programs embedded in the kernel image, see UPROGS in the Makefile. */
+extern char _binary_user_init_start[], _binary_user_init_size[];
+extern char _binary_user_worker_start[], _binary_user_worker_size[];
+
+static const struct program {
+    const char *name;
+    char       *start;
+    char       *size;   /** Symbol address is the size. */
+} programs[] = {
+    { "init",   _binary_user_init_start,   _binary_user_init_size },
+    { "worker", _binary_user_worker_start, _binary_user_worker_size },
+};
+
+static const struct program *
+program_find(const char *path)
+{
+    if(*path == '/')
+        path++;
+    for(uint32_t i = 0; i < NELEM(programs); i++)
+        if(strncmp(programs[i].name, path, strlen(programs[i].name) + 1) == 0)
+            return &programs[i];
+    return NULL;
+}
+
+/**
+ * Set up p's fresh address space for the ELF image prog, and its trap frame
+ * to enter it.
+ *
+ * Nothing is copied nor mapped here: each loadable segment becomes an area,
+ * writable or not as the segment, whose pages are filled from the image on
+ * first touch, bss included. Segments need not be page aligned, but must sit
+ * at the same page offset in the image and in memory, which ld ensures.
+ */
+static int
+process_load(struct process *p, const struct program *prog)
+{
+    const struct elfhdr *elf = (const struct elfhdr *)prog->start;
+    uint32_t imgsz = (uint32_t)prog->size;
+    uint32_t top = 0;
+
+    if(imgsz < sizeof(*elf) || elf->magic != ELF_MAGIC ||
+       elf->phoff > imgsz ||
+       elf->phnum > (imgsz - elf->phoff) / sizeof(struct proghdr))
+        return -1;
+
+    const struct proghdr *ph = (const struct proghdr *)(prog->start + elf->phoff);
+    for(uint32_t i = 0; i < elf->phnum; i++, ph++){
+        if(ph->type != ELF_PROG_LOAD || ph->memsz == 0)
+            continue;
+        uint32_t delta = ph->vaddr % PGSIZE;  // image bytes before, same page
+        if(ph->memsz < ph->filesz || ph->vaddr + ph->memsz < ph->vaddr ||
+           ph->off < delta || ph->off > imgsz || ph->filesz > imgsz - ph->off)
+            return -1;
+
+        bool write = ph->flags & ELF_PROG_FLAG_WRITE;
+        if(vma_add(p, write ? VMA_DATA : VMA_CODE, ph->vaddr,
+                   ph->vaddr + ph->memsz, write ? VMA_WRITE : 0,
+                   prog->start + ph->off - delta, ph->filesz + delta) == 0)
+            return -1;
+        if(ph->vaddr + ph->memsz > top)
+            top = ph->vaddr + ph->memsz;
+    }
+
+    if(top == 0 ||
+       vma_add(p, VMA_HEAP, PGROUNDUP(top), PGROUNDUP(top) + UHEAPSIZE,
+               VMA_WRITE, NULL, 0) == 0 ||
+       vma_add(p, VMA_STACK, USTACKTOP - USTACKSIZE, USTACKTOP,
+               VMA_WRITE, NULL, 0) == 0)
+        return -1;
+
+    memset(p->tf, 0, sizeof(*p->tf));
+    p->tf->cs = (SEG_UCODE << 3) | DPL_USER;  // 0x1B
+    p->tf->ds = (SEG_UDATA << 3) | DPL_USER;  // 0x23
+    p->tf->gs = p->tf->ds;
+    // es = fs = ds in trapret
+    p->tf->ss = p->tf->ds;
+    p->tf->eflags = FL_IF;
+    p->tf->esp = USTACKTOP;
+    p->tf->eip = elf->entry;
+
+    strncpy(p->name, prog->name, sizeof(p->name) - 1);
+    return 0;
+}
+
 /**
  * Initialize the `init` process - put it in RUNNABLE state in the process
  * table so the scheduler can pick it up.
@@ -118,10 +332,6 @@ process_alloc(void)
 void
 initproc_init(void)
 {
-    /** Get the embedded binary of `init.s`. */
-    extern char _binary_user_init_start[];
-    extern char _binary_user_init_size[];
-
     struct process *p = process_alloc();
     assert(p != NULL);
 
@@ -129,45 +339,123 @@ initproc_init(void)
     if((p->pgdir = setupkvm()) == 0)
         panic("initproc: out of memory?");
 
-    inituvm(p->pgdir, _binary_user_init_start, (int)_binary_user_init_size);
+    if(process_load(p, program_find("init")) < 0)
+        panic("initproc: bad address space layout");
 
-    p->sz = PGSIZE;
+    // Queuing p lets cpus run it. The run queue lock forces the above
+    // writes to be visible.
+    process_start(p);
+}
 
-    memset(p->tf, 0, sizeof(*p->tf));
-    p->tf->cs = (SEG_UCODE << 3) | DPL_USER;  // 0x1B
-    p->tf->ds = (SEG_UDATA << 3) | DPL_USER;  // 0x23
-    // es = ds in trapret
-    p->tf->ss = p->tf->ds;
-    p->tf->eflags = FL_IF;
-    p->tf->esp = PGSIZE;
-    p->tf->eip = 0;  // beginning of init
+/**
+ * Create a process running the program at path with arguments argv (NULL
+ * terminated, at most MAXARG). Unlike fork() then exec, the caller's address
+ * space isn't touched at all: the child starts from a fresh one, in which
+ * only the stack page holding the arguments is mapped up front.
+ *
+ * Returns the child's pid, -1 on failure.
+ */
+int
+spawn(const char *path, char **argv)
+{
+    const struct program *prog;
+    struct process *np;
+    uint32_t argc, sp, ustack[3 + MAXARG + 1];
+
+    if((prog = program_find(path)) == NULL)
+        return -1;
+
+    if((np = process_alloc()) == 0)
+        return -1;
+
+    if((np->pgdir = setupkvm()) == 0 || process_load(np, prog) < 0)
+        goto bad;
+
+    // Argument strings, then main()'s frame, all on the top stack page.
+    sp = USTACKTOP;
+    if(vma_fault(np, sp - 1, true, false) < 0)
+        goto bad;
+    for(argc = 0; argv[argc]; argc++){
+        if(argc >= MAXARG)
+            goto bad;
+        uint32_t len = strlen(argv[argc]) + 1;
+        if(sp - (USTACKTOP - PGSIZE) < len + sizeof(ustack))
+            goto bad;
+        sp = (sp - len) & ~3;
+        if(copyout(np->pgdir, sp, argv[argc], len) < 0)
+            goto bad;
+        ustack[3 + argc] = sp;
+    }
+    ustack[3 + argc] = 0;
+
+    ustack[0] = 0xffffffff;  // fake return PC
+    ustack[1] = argc;
+    ustack[2] = sp - (argc + 1) * 4;  // argv pointer
+
+    sp -= (3 + argc + 1) * 4;
+    if(copyout(np->pgdir, sp, ustack, (3 + argc + 1) * 4) < 0)
+        goto bad;
+    np->tf->esp = sp;
+    np->parent = myproc();
+
+    int pid = np->pid;
+    process_start(np);
+    return pid;
+
+ bad:
+    if(np->pgdir)
+        freevm(np->pgdir);
+    np->pgdir = 0;
+    acquire(&ptable.lock);
+    process_free(np);
+    release(&ptable.lock);
+    return -1;
+}
 
-    strncpy(p->name, "init", sizeof(p->name) - 1);
+// Create a new process copying the current one. Memory isn't copied but
+// shared copy-on-write, see copyuvm(), so forking costs page tables only.
+// Returns the child's pid to the parent, 0 to the child, -1 on failure.
+int
+fork(void)
+{
+  struct process *np;
+  struct process *curproc = myproc();
 
-    // this assignment to p->state lets other cores
-    // run this process. the acquire forces the above
-    // writes to be visible, and the lock is also needed
-    // because the assignment might not be atomic.
+  if((np = process_alloc()) == 0)
+    return -1;
+
+  if((np->pgdir = copyuvm(curproc->pgdir)) == 0){
     acquire(&ptable.lock);
+    process_free(np);
+    release(&ptable.lock);
+    return -1;
+  }
+  vma_fork(np, curproc);
+  np->parent = curproc;
+  *np->tf = *curproc->tf;
 
-    /** Set process state to RUNNABLE so the scheduler can pick it up. */
-    p->state = RUNNABLE;
+  // Clear %eax so that fork returns 0 in the child.
+  np->tf->eax = 0;
 
-    release(&ptable.lock);
+  strncpy(np->name, curproc->name, sizeof(np->name) - 1);
+
+  int pid = np->pid;
+  process_start(np);
+  return pid;
 }
 
-// Enter scheduler.  Must hold only ptable.lock
-// and have changed proc->state. Saves and restores
+// Enter scheduler.  Must have interrupts disabled
+// by a single pushcli(), holding no lock, and have
+// changed proc->state. The scheduler queues p again
+// if RUNNABLE, once off its stack. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
 // be proc->intena and proc->ncli, but that would
 // break in the few places where a lock is held but
 // there's no process.
-void
+static void
 enter_scheduler(void)   // sched() in xv6
 {
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   struct process *p = myproc();
@@ -185,7 +473,8 @@ enter_scheduler(void)   // sched() in xv6
 
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
-// until its parent calls wait() to find out it exited.
+// until its parent calls wait() to find out it exited,
+// or is freed right away if it has no parent anymore.
 void
 exit(int status)
 {
@@ -194,7 +483,34 @@ exit(int status)
   if(p == initproc)
     warn("init exiting"); // TODO panic
 
+  // Nobody will wait for our children: free those already dead, and have
+  // the others freed as they exit, see scheduler().
   acquire(&ptable.lock);
+  for(struct process *q = ptable.proc; q < &ptable.proc[NPROC]; q++){
+    if(q->parent != p)
+      continue;
+    q->parent = 0;
+    if(q->state == ZOMBIE && q->cpu == 0)
+      process_free(q);
+  }
+  release(&ptable.lock);
+
+  // Don't leave the dying address space lazily loaded behind us, nor on the
+  // cpus p ran on before: they let go of it once idle or running another
+  // process, see scheduler().
+  switchkvm();
+  for(struct cpu *c = cpus; c < cpus + ncpu; c++)
+    while(c->pgdir == p->pgdir)
+      pause();
+
+  // Give the address space back now: shared segments and device pages are
+  // released as soon as their last user is gone.
+  vma_release(p);
+  shm_exit(p->pid);
+  freevm(p->pgdir);
+  p->pgdir = 0;
+
+  pushcli();
 
   // Jump into the scheduler, never to return.
   p->xstate = status;
@@ -203,24 +519,159 @@ exit(int status)
   panic("zombie exit");
 }
 
+/**
+ * Wait for a child process to exit, free it and return its pid, with its
+ * exit status in *status unless null. Returns -1 if we have no children.
+ * Without sleep and wakeup, we give up the cpu while waiting.
+ */
+int
+wait(int32_t *status)
+{
+  struct process *p = myproc();
+
+  for(;;){
+    bool havekids = false;
+    acquire(&ptable.lock);
+    for(struct process *q = ptable.proc; q < &ptable.proc[NPROC]; q++){
+      if(q->parent != p)
+        continue;
+      havekids = true;
+      // Once off its cpu, see scheduler().
+      if(q->state == ZOMBIE && q->cpu == 0){
+        int pid = q->pid;
+        int32_t xstate = q->xstate;
+        process_free(q);
+        release(&ptable.lock);
+        if(status)
+          *status = xstate;
+        return pid;
+      }
+    }
+    release(&ptable.lock);
+    if(!havekids)
+      return -1;
+    yield();
+  }
+}
 
-// Disable interrupts so that we are not rescheduled
-// while reading proc from the cpu structure
-struct process* myproc(void) {
+// Give up the CPU for one scheduling round.
+void
+yield(void)
+{
   pushcli();
-  struct cpu *c = mycpu();
-  struct process *p = c->proc;
+  myproc()->state = RUNNABLE;
+  enter_scheduler();
   popcli();
-  return p;
 }
 
+/**
+ * Keep p from running while this cpu changes its page tables, as another
+ * cpu's TLB couldn't be flushed: take it off its run queue, unless it's us.
+ * Returns false if p has no page tables, or runs or is about to elsewhere.
+ * Must hold ptable.lock. See process_unpin().
+ */
+bool
+process_pin(struct process *p)
+{
+    if(p->pgdir == 0)
+        return false;
+    if(p == myproc())
+        return true;
+
+    struct cpu *c = p->cpu;
+    if(c == 0)
+        return false;
+    acquire(&c->rq.lock);
+    bool queued = p->onrq && p->cpu == c;   // not stolen meanwhile
+    if(queued)
+        rq_remove(&c->rq, p);
+    release(&c->rq.lock);
+    return queued;
+}
 
+/** Let p pinned by process_pin() run again. */
+void
+process_unpin(struct process *p)
+{
+    if(p != myproc())
+        runqueue_add(p->cpu, p);
+}
 
-static inline void proc_load_task_reg(uint16_t sel)
+/**
+ * Free up to n frames by swapping out cold pages of live processes, each one
+ * taking its turn of the clock where the last call left off, see swap_scan().
+ * Every process gets at most two turns per call: pages spared in the first
+ * one for being recently used may go in the second. Returns the number of
+ * frames freed.
+ */
+uint32_t
+process_reclaim(uint32_t n)
 {
-    __asm__ __volatile__ ( "ltr %0" : : "r" (sel) );
+    static uint32_t hand;   // moved by other cpus' reclaims too: a mere hint
+    uint32_t freed = 0;
+
+    for(uint32_t i = 0; i < 2 * NPROC && freed < n; i++){
+        struct process *p = &ptable.proc[hand];
+        acquire(&ptable.lock);
+        bool pinned = process_pin(p);
+        release(&ptable.lock);
+        // Pinned, p can neither run nor exit: no need for a lock across the
+        // disk writes.
+        if(pinned){
+            freed += swap_scan(p, n - freed);
+            process_unpin(p);
+        }
+        if(freed < n)
+            hand = (hand + 1) % NPROC;
+    }
+    return freed;
 }
 
+/**
+ * Advance same-page merging by a batch of pages, resuming where the last call
+ * stopped. Once past the last process, a new round starts. Called by the
+ * scheduler when idle.
+ */
+void
+process_ksm_idle(void)
+{
+    static uint32_t hand;
+    uint32_t budget = KSM_SCAN_BATCH;
+
+    acquire(&ptable.lock);
+    for(uint32_t i = 0; i < NPROC && budget > 0; i++){
+        struct process *p = &ptable.proc[hand];
+        if(process_pin(p)){
+            bool done = ksm_scan(p, &budget);
+            process_unpin(p);
+            if(!done)
+                break;  // more of p next time
+        }
+        if((hand = (hand + 1) % NPROC) == 0)
+            ksm_round();
+    }
+    release(&ptable.lock);
+}
+
+
+
+
+// Load the CR3 register with pgdir, unless it is already there and its
+// page tables weren't changed by another cpu meanwhile.
+static void
+switchpgdir(struct cpu *c, pde_t *pgdir)
+{
+  if(c->pgdir == pgdir && !c->pgdir_stale)
+    return;
+  c->pgdir = pgdir;
+  c->pgdir_stale = false;
+  paging_switch_pgdir((void*)V2P(pgdir));
+}
+
+// Prepare this cpu to run p. The TSS was loaded once by gdt_init(), only its
+// kernel stack pointer changes. The kernel half being shared by all page
+// directories, CR3 is only written if p's address space isn't already loaded,
+// e.g. when the scheduler picks the same process again.
 void
 switchuvm(struct process *p)
 {
@@ -232,31 +683,19 @@ switchuvm(struct process *p)
     panic("switchuvm: no pgdir");
 
   pushcli();
-  gdt_set_entry(&mycpu()->gdt[SEG_TSS],
-                /* base */ (uint32_t)&mycpu()->ts,
-                /* limit */ sizeof(mycpu()->ts)-1,
-                /* access */ SEG_PRESENT|SEG_RING0|SEG_TSS32_AVAIL, // 0x89 0b10001001
-                /* flags */ 0); // 16-bit segment
-  // SS0 and ESP0 are used by software interrupts.
-  //
-  // Reminder(see gdt_load.asm): selector in segmentation consists of
-  // [15-3: idx, 2: table indicator, 1-0: requested privilege level].
-  mycpu()->ts.ss0 = SEG_KDATA << 3;
   mycpu()->ts.esp0 = (uint32_t)p->kstack + KSTACKSIZE;
-  // setting IOPL=0 in eflags *and* iomb beyond the tss segment limit
-  // forbids I/O instructions (e.g., inb and outb) from user space
-  mycpu()->ts.iomb = (uint16_t) 0xFFFF;
-  proc_load_task_reg(SEG_TSS << 3);
-  paging_switch_pgdir((void*)V2P(p->pgdir));  // switch to process's address space
+  switchpgdir(mycpu(), p->pgdir);  // switch to process's address space
   popcli();
 }
 
-// Switch h/w page table register to the kernel-only page table,
-// for when no process is running.
+// Switch h/w page table register to the kernel-only page table, for when no
+// process address space may be used anymore (e.g. it is about to be freed).
 void
 switchkvm(void)
 {
-  paging_switch_pgdir((pde_t*)V2P(kpgdir));  // switch to the kernel page table
+  pushcli();
+  switchpgdir(mycpu(), kpgdir);  // switch to the kernel page table
+  popcli();
 }
 
 // Per-CPU process scheduler.
@@ -269,7 +708,6 @@ switchkvm(void)
 void
 scheduler(void)
 {
-  struct process *p;
   struct cpu *c = mycpu();
   c->proc = 0;
 
@@ -277,29 +715,44 @@ scheduler(void)
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
+    // Interrupts stay disabled until the process we switch to enables
+    // them, and until we're back from it.
+    pushcli();
+    struct process *p = runqueue_pick(c);
+    if(p){
       c->proc = p;
       switchuvm(p);
-      p->state = RUNNING;
 
       swtch(&(c->scheduler), p->context);
 
-      switchkvm();
+      // Lazy TLB: keep running on p's page directory. The scheduler only
+      // touches the kernel half, which is the same everywhere.
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
       c->proc = 0;
+      if(p->state == RUNNABLE)
+        runqueue_add(c, p);
+      if(p->state == ZOMBIE){
+        // Off its kernel stack now: it may be freed, by its parent's wait()
+        // or by us if it has none left, see exit().
+        acquire(&ptable.lock);
+        p->cpu = 0;
+        if(p->parent == 0)
+          process_free(p);
+        release(&ptable.lock);
+      }
     }
-    release(&ptable.lock);
+    popcli();
 
+    // Nothing to run: let go of the last address space, which may be about
+    // to be freed, see exit(). Then prepare zeroed frames for later
+    // allocations, or look for pages to merge.
+    if(p == 0){
+      switchkvm();
+      if(!kalloc_zero_idle())
+        process_ksm_idle();
+    }
   }
 
 }
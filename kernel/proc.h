@@ -1,12 +1,17 @@
 #ifndef PROC_H
 #define PROC_H
 
+#include "cpu.h"
 #include "idt.h"
 #include "paging.h"
+#include "vma.h"
 
 /** Max number of processes at any time. */
 #define NPROC 64
 
+/** Max number of arguments passed to a new program. */
+#define MAXARG 16
+
 /** Each process has a kernel stack of one page. */
 #define KSTACKSIZE PGSIZE
 
@@ -43,10 +48,19 @@ struct process {
     struct context         *context;  /** Registers context */
     enum process_state      state;    /** Process state */
     int32_t                 xstate;   // Exit status to be returned to parent's wait
+    struct process         *parent;   /** Parent process */
     pde_t                  *pgdir;    /** Process page directory */
     uint32_t                kstack;   /** Beginning of kernel stack for this process */
-    uint32_t                sz;       /** Size of process memory (bytes) */
+    struct vma              vmas[NVMA]; /** User address space areas */
+    struct vma_hugestats    hugestats;
+    uint32_t                swaphand; /** Next page for the swap clock */
+    uint32_t                ksmhand;  /** Next page for ksm_scan() */
     struct interrupt_state *tf;       /** Trap state of latest trap (syscall) */
+    struct cpu             *cpu;      /** Cpu whose run queue has p, or last
+                                          ran it. Null once exited. */
+    bool                    onrq;     /** On cpu->rq, */
+    struct process         *rqnext;   /** between these. */
+    struct process         *rqprev;
     // ... (TODO)
 };
 
@@ -57,10 +71,19 @@ extern struct ptable ptable;
 void process_init();
 void initproc_init(void);
 
+int fork(void);
+int spawn(const char *path, char **argv);
 void exit(int status);
+int wait(int32_t *status);
+void yield(void);
 
-struct process* myproc(void);
+bool process_pin(struct process *p);
+void process_unpin(struct process *p);
+uint32_t process_reclaim(uint32_t n);
+void process_ksm_idle(void);
 
+void switchuvm(struct process *p);
+void switchkvm(void);
 void scheduler(void);
 
 #endif /* PROC_H */
@@ -0,0 +1,139 @@
+#include "lib/debug.h"
+#include "lib/string.h"
+#include "kalloc.h"
+#include "paging.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "vmalloc.h"
+
+#include "shm.h"
+
+static struct {
+  struct spinlock lock;
+  struct shm segs[NSHM];
+} shmtable;
+
+// Free s and its frames. Must hold shmtable.lock.
+static void
+shm_free(struct shm *s)
+{
+  for(uint32_t i = 0; i < s->npages; i++)
+    if(s->frames[i])
+      kref_put(s->frames[i]);
+  kvfree(s->frames);
+  memset(s, 0, sizeof(*s));
+}
+
+// Id of the segment with the given key, created with size bytes if there is
+// none, or if key is SHM_PRIVATE. Returns -1 if an existing segment is
+// smaller than size, or on lack of room.
+int
+shm_get(int key, uint32_t size)
+{
+  struct shm *s, *free = 0;
+  int id = -1;
+
+  if(size == 0 || size > SHM_MAX_SIZE)
+    return -1;
+  uint32_t npages = PGROUNDUP(size) / PGSIZE;
+
+  acquire(&shmtable.lock);
+  for(s = shmtable.segs; s < &shmtable.segs[NSHM]; s++){
+    if(!s->used){
+      if(free == 0)
+        free = s;
+    } else if(key != SHM_PRIVATE && s->key == key){
+      if(s->npages >= npages)
+        id = s - shmtable.segs;
+      goto out;
+    }
+  }
+  if(free == 0 || (free->frames = kvmalloc(npages * sizeof(char*))) == 0)
+    goto out;
+  memset(free->frames, 0, npages * sizeof(char*));
+  free->key = key;
+  free->npages = npages;
+  free->ref = 0;
+  free->creator = myproc()->pid;
+  free->used = true;
+  id = free - shmtable.segs;
+
+ out:
+  release(&shmtable.lock);
+  return id;
+}
+
+// Segment id, with a reference taken for a new attachment, or NULL.
+struct shm *
+shm_hold(int id)
+{
+  struct shm *s = 0;
+
+  if(id < 0 || id >= NSHM)
+    return 0;
+  acquire(&shmtable.lock);
+  if(shmtable.segs[id].used){
+    s = &shmtable.segs[id];
+    s->ref++;
+  }
+  release(&shmtable.lock);
+  return s;
+}
+
+// Take one more reference to s, e.g. when an attachment is copied by fork().
+void
+shm_dup(struct shm *s)
+{
+  acquire(&shmtable.lock);
+  s->ref++;
+  release(&shmtable.lock);
+}
+
+// Drop a reference to s, freeing it with the last one.
+void
+shm_release(struct shm *s)
+{
+  acquire(&shmtable.lock);
+  if(s->ref == 0)
+    panic("shm_release");
+  if(--s->ref == 0)
+    shm_free(s);
+  release(&shmtable.lock);
+}
+
+// Frame of page idx of s, with a reference taken for the caller. Allocated
+// zeroed if needed and alloc, otherwise NULL.
+char *
+shm_page(struct shm *s, uint32_t idx, bool alloc)
+{
+  char *frame;
+
+  acquire(&shmtable.lock);
+  if(idx >= s->npages)
+    panic("shm_page");
+  if((frame = s->frames[idx]) == 0 && alloc &&
+     (frame = kalloc_zeroed()) != 0){
+    frame_info(V2P(frame))->ref = 1;  // the segment's
+    s->frames[idx] = frame;
+  }
+  if(frame)
+    kref_get(frame);
+  release(&shmtable.lock);
+  return frame;
+}
+
+// Free the segments created by process pid which nobody attached, pid
+// exiting.
+void
+shm_exit(uint16_t pid)
+{
+  acquire(&shmtable.lock);
+  for(struct shm *s = shmtable.segs; s < &shmtable.segs[NSHM]; s++)
+    if(s->used && s->ref == 0 && s->creator == pid)
+      shm_free(s);
+  release(&shmtable.lock);
+}
+
+void shm_init(void) {
+    initlock(&shmtable.lock, "shm");
+}
@@ -0,0 +1,38 @@
+/**
+ * Shared memory segments, System V style: created by key with shmget(), then
+ * attached by any number of processes with shmat(). Frames are allocated on
+ * first touch and belong to the segment, which is freed once the last
+ * attachment goes away, be it by shmdt(), munmap() or exit(). A segment
+ * never attached is freed when its creator exits.
+ */
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Max number of segments at any time. */
+#define NSHM 16
+/** Max segment size. */
+#define SHM_MAX_SIZE (16 * 1024 * 1024)
+/** shmget() key for a new segment that can't be looked up by others. */
+#define SHM_PRIVATE 0
+
+struct shm {
+  int       key;
+  uint32_t  npages;
+  char    **frames;   /** Frame of each page, allocated on first touch. */
+  uint32_t  ref;      /** Areas attached to the segment. */
+  uint16_t  creator;  /** Pid of the process which created it. */
+  bool      used;
+};
+
+int shm_get(int key, uint32_t size);
+struct shm *shm_hold(int id);
+void shm_dup(struct shm *s);
+void shm_release(struct shm *s);
+char *shm_page(struct shm *s, uint32_t idx, bool alloc);
+void shm_exit(uint16_t pid);
+void shm_init(void);
+
+#endif /* SHM_H */
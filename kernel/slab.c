@@ -0,0 +1,341 @@
+// Slab allocator, after Bonwick's "The Slab Allocator: An Object-Caching
+// Kernel Memory Allocator" (USENIX 1994), simplified.
+//
+// A slab is a naturally aligned buddy block of 2^order frames. It starts with
+// a header, followed by the index array chaining its free objects, then the
+// objects themselves. Free objects are chained by index rather than through
+// their own memory, so that they stay in their constructed state. All frames
+// of a slab are flagged FRAME_SLAB in the frame table, which lets kmfree()
+// find the slab, hence the cache, of any object.
+
+#include "drivers/screen.h"
+#include "lib/debug.h"
+#include "lib/string.h"
+#include "lib/utils.h"
+#include "cpu.h"
+#include "kalloc.h"
+#include "paging.h"
+
+#include "slab.h"
+
+#define SLAB_MAX_ORDER 3    // largest slab: 8 frames
+#define SLAB_MIN_OBJS  8    // grow slabs until they hold that many objects
+#define SLAB_FREE_END  0xFFFF
+
+#define ALIGNUP(x, a)  ((((x) + (a) - 1) / (a)) * (a))
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;
+  struct slab *prev;
+  uint16_t inuse;       // objects handed out
+  uint16_t free;        // index of the first free object
+  uint16_t bufctl[];    // index of the next free object
+};
+
+/** The cache of cache descriptors. */
+static struct kmem_cache cache_cache;
+
+/** All caches. */
+static struct kmem_cache *caches;
+static struct spinlock caches_lock;
+
+/** kmalloc() size classes: 16, 32, ..., KMALLOC_MAX_CLASS bytes. */
+#define KMALLOC_MIN_CLASS 16
+static const char *kmalloc_names[] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+static struct kmem_cache *kmalloc_caches[NELEM(kmalloc_names)];
+
+
+static void
+slab_list_add(struct slab **list, struct slab *s)
+{
+  s->prev = 0;
+  s->next = *list;
+  if(*list)
+    (*list)->prev = s;
+  *list = s;
+}
+
+static void
+slab_list_remove(struct slab **list, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    *list = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+static inline void *
+slab_obj(struct kmem_cache *c, struct slab *s, uint32_t idx)
+{
+  return (char*)s + c->first + idx * c->size;
+}
+
+// Slab containing obj: slabs are aligned on their size.
+static inline struct slab *
+slab_of(void *obj, uint32_t order)
+{
+  return (struct slab*)((uint32_t)obj & ~((PGSIZE << order) - 1));
+}
+
+static void
+slab_mark_frames(struct slab *s, uint32_t order, bool slab)
+{
+  for(uint32_t i = 0; i < (1u << order); i++){
+    struct frame_info *fi = frame_info(V2P(s) + i * PGSIZE);
+    if(slab){
+      fi->flags |= FRAME_SLAB;
+      fi->order = order;
+    } else {
+      fi->flags &= ~FRAME_SLAB;
+    }
+  }
+}
+
+// Add a new slab to the cache. Must hold c->lock.
+static struct slab *
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s = (struct slab*)kalloc_pages(c->order);
+  if(s == 0)
+    return 0;
+  slab_mark_frames(s, c->order, true);
+
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  for(uint32_t i = 0; i < c->objs_per_slab; i++){
+    s->bufctl[i] = (i + 1 < c->objs_per_slab) ? i + 1 : SLAB_FREE_END;
+    if(c->ctor)
+      c->ctor(slab_obj(c, s, i));
+  }
+  slab_list_add(&c->partial, s);
+  c->nslabs++;
+  return s;
+}
+
+// Take an object from the slabs. Must hold c->lock.
+static void *
+slab_alloc_obj(struct kmem_cache *c)
+{
+  struct slab *s = c->partial;
+  if(s == 0 && (s = slab_grow(c)) == 0)
+    return 0;
+
+  uint16_t idx = s->free;
+  s->free = s->bufctl[idx];
+  s->inuse++;
+  if(s->free == SLAB_FREE_END){
+    slab_list_remove(&c->partial, s);
+    slab_list_add(&c->full, s);
+  }
+  c->nactive++;
+  return slab_obj(c, s, idx);
+}
+
+// Give an object back to its slab, releasing the slab once empty. Must hold
+// c->lock.
+static void
+slab_free_obj(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = slab_of(obj, c->order);
+  if(s->cache != c)
+    panic("kmem_cache_free: wrong cache");
+
+  uint16_t idx = ((char*)obj - (char*)s - c->first) / c->size;
+  if(s->free == SLAB_FREE_END){
+    slab_list_remove(&c->full, s);
+    slab_list_add(&c->partial, s);
+  }
+  s->bufctl[idx] = s->free;
+  s->free = idx;
+  s->inuse--;
+  c->nactive--;
+
+  if(s->inuse == 0){
+    slab_list_remove(&c->partial, s);
+    slab_mark_frames(s, c->order, false);
+    kfree_pages((char*)s, c->order);
+    c->nslabs--;
+  }
+}
+
+static void
+cache_setup(struct kmem_cache *c, const char *name, size_t size,
+            size_t align, uint32_t flags, void (*ctor)(void *))
+{
+  if(align < sizeof(void*))
+    align = sizeof(void*);
+  if((flags & KMEM_CACHE_HWALIGN) && align < CACHELINE_SIZE)
+    align = CACHELINE_SIZE;
+
+  memset(c, 0, sizeof(*c));
+  strncpy(c->name, name, KMEM_CACHE_NAME_LEN - 1);
+  c->objsize = size;
+  c->size = ALIGNUP(size, align);
+  c->ctor = ctor;
+
+  // Smallest slab holding enough objects.
+  uint32_t n = 0;
+  for(c->order = 0; c->order <= SLAB_MAX_ORDER; c->order++){
+    uint32_t slabsz = PGSIZE << c->order;
+    n = (slabsz - sizeof(struct slab)) / (c->size + sizeof(uint16_t));
+    while(n > 0 &&
+          ALIGNUP(sizeof(struct slab) + n * sizeof(uint16_t), align)
+          + n * c->size > slabsz)
+      n--;
+    if(n >= SLAB_MIN_OBJS || c->order == SLAB_MAX_ORDER)
+      break;
+  }
+  if(n == 0)
+    panic("kmem_cache_create: object too large");
+  c->objs_per_slab = n;
+  c->first = ALIGNUP(sizeof(struct slab) + n * sizeof(uint16_t), align);
+
+  initlock(&c->lock, c->name);
+
+  acquire(&caches_lock);
+  c->next = caches;
+  caches = c;
+  release(&caches_lock);
+}
+
+// Create a cache of objects of the given size. Objects are aligned on align
+// bytes, or on cache lines with KMEM_CACHE_HWALIGN. ctor, if any, is run on
+// each object when its slab is created, not on each allocation: freed objects
+// are expected to be returned in their constructed state.
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align, uint32_t flags,
+                  void (*ctor)(void *))
+{
+  struct kmem_cache *c = kmem_cache_alloc(&cache_cache);
+  if(c == 0)
+    return 0;
+  cache_setup(c, name, size, align, flags, ctor);
+  return c;
+}
+
+// Allocate an object. Served from this cpu's array when possible, which is
+// refilled with half of its capacity at once otherwise.
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  void *obj = 0;
+
+  pushcli();
+  struct kmem_cpu_cache *cc = &c->cpu[mycpu() - cpus];
+  if(cc->count == 0){
+    acquire(&c->lock);
+    while(cc->count < KMEM_CPU_CACHE_SIZE / 2){
+      void *o = slab_alloc_obj(c);
+      if(o == 0)
+        break;
+      cc->objs[cc->count++] = o;
+    }
+    release(&c->lock);
+  }
+  if(cc->count > 0)
+    obj = cc->objs[--cc->count];
+  popcli();
+  return obj;
+}
+
+// Free an object to this cpu's array. When full, half of it goes back to the
+// slabs.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  pushcli();
+  struct kmem_cpu_cache *cc = &c->cpu[mycpu() - cpus];
+  if(cc->count == KMEM_CPU_CACHE_SIZE){
+    acquire(&c->lock);
+    while(cc->count > KMEM_CPU_CACHE_SIZE / 2)
+      slab_free_obj(c, cc->objs[--cc->count]);
+    release(&c->lock);
+  }
+  cc->objs[cc->count++] = obj;
+  popcli();
+}
+
+// Allocate size bytes from the smallest fitting size class. Larger requests
+// get a block of whole frames.
+void *
+kmalloc(size_t size)
+{
+  if(size == 0)
+    return 0;
+
+  if(size > KMALLOC_MAX_CLASS){
+    uint32_t order = 0;
+    while((PGSIZE << order) < size)
+      order++;
+    char *mem = kalloc_pages(order);
+    if(mem){
+      struct frame_info *fi = frame_info(V2P(mem));
+      fi->flags |= FRAME_KMALLOC;
+      fi->order = order;
+    }
+    return mem;
+  }
+
+  uint32_t i = 0;
+  while((KMALLOC_MIN_CLASS << i) < size)
+    i++;
+  if(kmalloc_caches[i] == 0)
+    panic("kmalloc: slab_init() not called");
+  return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+void
+kmfree(void *obj)
+{
+  if(obj == 0)
+    return;
+
+  struct frame_info *fi = frame_info(V2P(PGROUNDDOWN(obj)));
+  if(fi->flags & FRAME_SLAB){
+    kmem_cache_free(slab_of(obj, fi->order)->cache, obj);
+  } else if(fi->flags & FRAME_KMALLOC){
+    fi->flags &= ~FRAME_KMALLOC;
+    kfree_pages(obj, fi->order);
+  } else {
+    panic("kmfree: not allocated by kmalloc");
+  }
+}
+
+/**
+ * Print the usage of each cache. Waste is the share of slab memory not
+ * holding an allocated object: internal fragmentation, partially used slabs
+ * and objects sitting in cpu arrays. A growing active count hints at a leak.
+ */
+void kmem_cache_dump(void) {
+    acquire(&caches_lock);
+    for(struct kmem_cache *c = caches; c; c = c->next){
+        uint32_t cached = 0;
+        for(int i = 0; i < MAX_CPUS; i++)
+            cached += c->cpu[i].count;
+        uint32_t active = c->nactive - cached;
+        uint32_t total = c->nslabs * c->objs_per_slab;
+        uint32_t bytes = c->nslabs * (PGSIZE << c->order);
+        cprintf("slab %s: objsize=%d active=%d/%d slabs=%d order=%d waste=%d%%\n",
+                c->name, c->objsize, active, total, c->nslabs, c->order,
+                bytes ? (bytes - active * c->objsize) * 100 / bytes : 0);
+    }
+    release(&caches_lock);
+}
+
+void slab_init(void) {
+    initlock(&caches_lock, "kmem_caches");
+    cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, 0, 0);
+    for(uint32_t i = 0; i < NELEM(kmalloc_names); i++){
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i],
+                                              KMALLOC_MIN_CLASS << i, 0, 0, 0);
+        if(kmalloc_caches[i] == 0)
+            panic("slab_init");
+    }
+}
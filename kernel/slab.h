@@ -0,0 +1,70 @@
+/**
+ * Slab allocator for small kernel objects, on top of the frame allocator.
+ *
+ * Objects of a given size live in named caches (kmem_cache_create()). Each
+ * cache carves slabs, blocks of 2^order frames, into equal objects. The last
+ * freed objects are kept in small per-cpu arrays, taken and refilled without
+ * the cache lock. kmalloc()/kmfree() serve arbitrary sizes from power of 2
+ * size classes.
+ */
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "drivers/acpi.h"
+#include "spinlock.h"
+
+#define CACHELINE_SIZE 64
+
+/** kmem_cache_create() flags. */
+#define KMEM_CACHE_HWALIGN 0x1  /** Align objects on cache lines. */
+
+/** Objects kept by each cpu in front of a cache. */
+#define KMEM_CPU_CACHE_SIZE 8
+
+#define KMEM_CACHE_NAME_LEN 16
+
+/** Largest kmalloc() size class, larger requests get whole pages. */
+#define KMALLOC_MAX_CLASS 2048
+
+struct kmem_cpu_cache {
+  uint32_t count;
+  void    *objs[KMEM_CPU_CACHE_SIZE];
+};
+
+struct slab;
+
+struct kmem_cache {
+  char     name[KMEM_CACHE_NAME_LEN];
+  uint32_t objsize;         /** Size requested at creation. */
+  uint32_t size;            /** Object stride, alignment included. */
+  uint32_t order;           /** Slabs are blocks of 2^order frames. */
+  uint32_t objs_per_slab;
+  uint32_t first;           /** Offset of the first object in a slab. */
+  void   (*ctor)(void *);   /** Called once per object, on slab creation. */
+
+  struct spinlock lock;
+  struct slab *partial;     /** Slabs with free objects. */
+  struct slab *full;        /** Slabs without free objects. */
+  uint32_t nslabs;
+  uint32_t nactive;         /** Objects handed out, cpu caches included. */
+
+  struct kmem_cpu_cache cpu[MAX_CPUS];
+  struct kmem_cache *next;  /** All caches, for kmem_cache_dump(). */
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, uint32_t flags,
+                                     void (*ctor)(void *));
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+void *kmalloc(size_t size);
+void kmfree(void *obj);
+
+void kmem_cache_dump(void);
+void slab_init(void);
+
+#endif /* SLAB_H */
@@ -29,8 +29,10 @@ acquire(struct spinlock *lk)
     panic("acquire");
 
   // The xchg is atomic.
+  // With interrupts disabled, meanwhile keep up with TLB shootdowns: their
+  // sender may be the lock holder, waiting for us.
   while(xchg(&lk->locked, 1) != 0)
-    ;
+    tlb_catch_up();
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -100,39 +102,3 @@ getcallerpcs(void *v, uint32_t pcs[])
   for(; i < 10; i++)
     pcs[i] = 0;
 }
-
-// Check whether this cpu is holding the lock.
-int
-holding(struct spinlock *lock)
-{
-  pushcli();
-  bool r = lock->locked && lock->cpu == mycpu();
-  popcli();
-  return r;
-}
-
-
-// Pushcli/popcli are like cli/sti except that they are matched:
-// it takes two popcli to undo two pushcli.  Also, if interrupts
-// are off, then pushcli, popcli leaves them off.
-
-void
-pushcli(void)
-{
-  int eflags = readeflags();
-  cli();
-  if(mycpu()->ncli == 0)
-    mycpu()->intena = eflags & FL_IF;
-  mycpu()->ncli += 1;
-}
-
-void
-popcli(void)
-{
-  if(readeflags() & FL_IF)
-    panic("popcli - interruptible");
-  if(--mycpu()->ncli < 0)
-    panic("popcli");
-  if(mycpu()->ncli == 0 && mycpu()->intena)
-    sti();
-}
@@ -67,10 +67,6 @@ void acquire(struct spinlock *lk);
 void release(struct spinlock *lk);
 
 void getcallerpcs(void *v, uint32_t pcs[]);
-int holding(struct spinlock *lock);
-
-void pushcli(void);
-void popcli(void);
 
 
 #endif /* SPINLOCK_H */
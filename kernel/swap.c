@@ -0,0 +1,288 @@
+#include "drivers/ide.h"
+#include "drivers/screen.h"
+#include "drivers/timer.h"
+#include "lib/debug.h"
+#include "lib/string.h"
+#include "cpu.h"
+#include "kalloc.h"
+#include "low_level.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "zram.h"
+
+#include "swap.h"
+
+#define BLOCKS_PER_PAGE (PGSIZE / BLOCK_SIZE)
+#define SLOT_BUSY       0x80    // swap.map flag: disk I/O in progress
+
+struct swap_stats swap_stats;
+
+static struct {
+  struct spinlock lock;
+  bool ready;
+  uint8_t map[SWAP_NSLOTS];   // references to each slot, 0 when free
+  uint32_t nfree;
+  uint32_t hint;              // where to look for a free slot next
+  // Per cpu: nothing gets allocated on the reclaim path.
+  struct block_req io[MAX_CPUS];
+} swap;
+
+// Read or write a page from or to slot, marked SLOT_BUSY by the caller.
+// Without swap.lock: other cpus keep going meanwhile.
+static bool
+swap_io(uint32_t slot, char *frame, bool write)
+{
+  bool ok = true;
+
+  pushcli();
+  struct block_req *b = &swap.io[mycpu() - cpus];
+  for(uint32_t i = 0; ok && i < BLOCKS_PER_PAGE; i++){
+    char *data = frame + i * BLOCK_SIZE;
+    b->dev = SWAP_DEV;
+    b->block_no = FSSIZE + slot * BLOCKS_PER_PAGE + i;
+    b->flags = 0;
+    if(write){
+      memmove(b->data, data, BLOCK_SIZE);
+      b->flags = BLOCK_DIRTY;
+    }
+    if((ok = ide_rw(b)) && !write)
+      memmove(data, b->data, BLOCK_SIZE);
+  }
+  popcli();
+  return ok;
+}
+
+// Wait for the I/O on slot to be over. Must hold swap.lock, released
+// meanwhile.
+static void
+swap_slot_wait(uint32_t slot)
+{
+  while(swap.map[slot] & SLOT_BUSY){
+    release(&swap.lock);
+    pause();
+    acquire(&swap.lock);
+  }
+}
+
+// Take a free slot, busy for the caller to write it, or return -1. Must hold
+// swap.lock.
+static int32_t
+swap_slot_alloc(void)
+{
+  for(uint32_t n = 0; n < SWAP_NSLOTS; n++){
+    uint32_t s = (swap.hint + n) % SWAP_NSLOTS;
+    if(swap.map[s] == 0){
+      swap.map[s] = 1 | SLOT_BUSY;
+      swap.nfree--;
+      swap.hint = s + 1;
+      return s;
+    }
+  }
+  return -1;
+}
+
+// Drop a reference to slot. Must hold swap.lock.
+static void
+swap_slot_put(uint32_t slot)
+{
+  if(slot >= SWAP_NSLOTS || (swap.map[slot] & ~SLOT_BUSY) == 0)
+    panic("swap_slot_put");
+  if(--swap.map[slot] == 0)
+    swap.nfree++;
+}
+
+// Make room when kalloc() runs out of frames. Never from code holding locks
+// (pushcli() nesting). The reclaim path only allocates with a lock held, so
+// doesn't recurse. Returns whether frames were freed.
+bool
+swap_reclaim(void)
+{
+  if(!swap.ready)
+    return false;
+
+  pushcli();
+  bool nested = mycpu()->ncli > 1;
+  popcli();
+  if(nested)
+    return false;
+
+  return process_reclaim(SWAP_BATCH) > 0;
+}
+
+/**
+ * Advance the clock over p's pages, from p->swaphand, writing out up to want
+ * unused ones. Only private anonymous pages are candidates: present, user
+ * writable, neither copy-on-write nor shared, mapped once. Recently accessed
+ * ones only lose their accessed bit. Returns the number of frames freed.
+ *
+ * p must be pinned, see process_pin(). No lock is held across disk writes.
+ */
+uint32_t
+swap_scan(struct process *p, uint32_t want)
+{
+  char *victims[SWAP_BATCH];
+  uint32_t n = 0, va = p->swaphand, scanned = 0, referenced = 0;
+  bool flush = false;
+
+  if(want > SWAP_BATCH)
+    want = SWAP_BATCH;
+
+  for(uint32_t i = 0; i < SWAP_SCAN_MAX && n < want; i++, va += PGSIZE){
+    if(va >= KERNBASE)
+      va = 0;
+    pde_t pde = p->pgdir[PDX(va)];
+    if((pde & (PTE_P|PTE_PS)) != PTE_P){
+      va = PGADDR(PDX(va) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
+    pte_t *pte = &((pte_t*)P2V(PTE_ADDR(pde)))[PTX(va)];
+    if((*pte & (PTE_P|PTE_U|PTE_W|PTE_COW|PTE_SHARED)) != (PTE_P|PTE_U|PTE_W))
+      continue;
+    char *mem = P2V(PTE_ADDR(*pte));
+    if(frame_info(V2P(mem))->ref != 1)
+      continue;
+
+    scanned++;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      referenced++;
+      flush = true;
+      continue;
+    }
+
+    int32_t slot = zram_store(mem);
+    if(slot >= 0){
+      slot |= SWAP_ZRAM;
+    } else {
+      acquire(&swap.lock);
+      if((slot = swap_slot_alloc()) < 0)
+        swap_stats.full++;
+      release(&swap.lock);
+      if(slot < 0)
+        break;
+
+      bool ok = swap_io(slot, mem, true);
+      acquire(&swap.lock);
+      swap.map[slot] &= ~SLOT_BUSY;
+      if(ok)
+        swap_stats.outs++;
+      else
+        swap_slot_put(slot);
+      release(&swap.lock);
+      if(!ok)
+        break;
+    }
+    *pte = SWAP_PTE(slot);
+    victims[n++] = mem;
+    flush = true;
+  }
+  p->swaphand = va;
+
+  acquire(&swap.lock);
+  swap_stats.scanned += scanned;
+  swap_stats.referenced += referenced;
+  release(&swap.lock);
+
+  // No stale translation may outlive the frames.
+  if(flush)
+    tlb_flush_pgdir(p->pgdir);
+  for(uint32_t i = 0; i < n; i++)
+    kref_put(victims[i]);
+  if(n > 0)
+    zram_refill();
+  return n;
+}
+
+// Bring back the page swapped out at va. Returns -1 on memory or disk
+// errors.
+int
+swap_in(pde_t *pgdir, uint32_t va)
+{
+  char *mem = kalloc();
+  if(mem == 0)
+    return -1;
+
+  pte_t *pte = walkpgdir(pgdir, va, false);
+  if(pte == 0 || !(*pte & PTE_SWAP))
+    panic("swap_in");
+  uint32_t slot = SWAP_SLOT(*pte);
+
+  if(slot & SWAP_ZRAM){
+    zram_load(slot & ~SWAP_ZRAM, mem);
+    zram_put(slot & ~SWAP_ZRAM);
+    goto map;
+  }
+
+  // Others sharing the slot may be reading it too, see swap_dup().
+  acquire(&swap.lock);
+  swap_slot_wait(slot);
+  swap.map[slot] |= SLOT_BUSY;
+  release(&swap.lock);
+  bool ok = swap_io(slot, mem, false);
+  acquire(&swap.lock);
+  swap.map[slot] &= ~SLOT_BUSY;
+  if(ok){
+    swap_slot_put(slot);
+    swap_stats.ins++;
+  }
+  release(&swap.lock);
+
+  if(!ok){
+    kfree(mem);
+    return -1;
+  }
+ map:
+  frame_info(V2P(mem))->ref = 1;
+  *pte = V2P(mem) | PTE_P | PTE_U | PTE_W;
+  return 0;
+}
+
+// One more page table entry refers to the slot of pte, e.g. after fork().
+void
+swap_dup(pte_t pte)
+{
+  if(SWAP_SLOT(pte) & SWAP_ZRAM){
+    zram_dup(SWAP_SLOT(pte) & ~SWAP_ZRAM);
+    return;
+  }
+  acquire(&swap.lock);
+  swap_slot_wait(SWAP_SLOT(pte));
+  if(swap.map[SWAP_SLOT(pte)] == SLOT_BUSY - 1)
+    panic("swap_dup");
+  swap.map[SWAP_SLOT(pte)]++;
+  release(&swap.lock);
+}
+
+// The swap entry pte goes away, releasing its slot with the last one.
+void
+swap_free(pte_t pte)
+{
+  if(SWAP_SLOT(pte) & SWAP_ZRAM){
+    zram_put(SWAP_SLOT(pte) & ~SWAP_ZRAM);
+    return;
+  }
+  acquire(&swap.lock);
+  swap_slot_wait(SWAP_SLOT(pte));
+  swap_slot_put(SWAP_SLOT(pte));
+  release(&swap.lock);
+}
+
+void swap_dump(void) {
+    uint32_t secs = (uint32_t)timer_ticks() / TIMER_FREQ_HZ;
+    if(secs == 0)
+        secs = 1;
+    cprintf("swap: used=%d/%d in=%d (%d/s) out=%d (%d/s) scanned=%d "
+            "referenced=%d full=%d\n",
+            SWAP_NSLOTS - swap.nfree, SWAP_NSLOTS,
+            swap_stats.ins, swap_stats.ins / secs,
+            swap_stats.outs, swap_stats.outs / secs,
+            swap_stats.scanned, swap_stats.referenced, swap_stats.full);
+}
+
+// Needs the disk, see ide_init().
+void swap_init(void) {
+    initlock(&swap.lock, "swap");
+    zram_init();
+    swap.nfree = SWAP_NSLOTS;
+    swap.ready = true;
+}
@@ -0,0 +1,55 @@
+/**
+ * Swap: when frames run out, cold anonymous pages of user processes are
+ * written to a swap area on disk, and read back on fault.
+ *
+ * Pages first go compressed to memory (see zram.h), then to a swap area
+ * following the file system on IDE device SWAP_DEV, in page sized slots. A
+ * swapped out page leaves a non-present PTE holding its slot, flagged
+ * PTE_SWAP, with SWAP_ZRAM for compressed pages. Victims are picked by a clock over the pages of each
+ * process in turn: a page accessed since the hand last passed (PTE_A) gets a
+ * second chance.
+ */
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fs/block.h"
+#include "paging.h"
+
+#define SWAP_DEV      1
+#define SWAP_NSLOTS   (SWAPSIZE / (PGSIZE / BLOCK_SIZE))
+/** Slot bit of pages held by zram, the rest being the zram slot. */
+#define SWAP_ZRAM     0x80000
+
+/** Frames freed at once when kalloc() runs out. */
+#define SWAP_BATCH    16
+/** Page table entries looked at per process and turn of the clock. */
+#define SWAP_SCAN_MAX 1024
+
+/** Swap PTE of a slot, and back. */
+#define SWAP_PTE(slot)  (((uint32_t)(slot) << PTXSHIFT) | PTE_SWAP)
+#define SWAP_SLOT(pte)  (PTE_ADDR(pte) >> PTXSHIFT)
+
+struct swap_stats {
+    uint32_t ins;           /** Pages read back from disk. */
+    uint32_t outs;          /** Pages written out to disk. */
+    uint32_t scanned;       /** Candidate pages looked at by the clock. */
+    uint32_t referenced;    /** Of which spared for being recently used. */
+    uint32_t full;          /** Reclaims cut short for lack of a free slot. */
+};
+
+extern struct swap_stats swap_stats;
+
+struct process;
+
+void swap_init(void);
+bool swap_reclaim(void);
+uint32_t swap_scan(struct process *p, uint32_t want);
+int swap_in(pde_t *pgdir, uint32_t va);
+void swap_dup(pte_t pte);
+void swap_free(pte_t pte);
+void swap_dump(void);
+
+#endif /* SWAP_H */
@@ -5,14 +5,33 @@
 
 extern int sys_hello(void);
 extern int sys_exit(void);
+extern int sys_yield(void);
+extern int sys_fork(void);
+extern int sys_spawn(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
+extern int sys_shmget(void);
+extern int sys_shmat(void);
+extern int sys_shmdt(void);
+extern int sys_wait(void);
+extern int sys_zpool(void);
 
 // For readability
 typedef int (*syscall_fn)(void);
 
 static syscall_fn syscalls[] = {
     [SYS_hello]   = sys_hello,
-    /* [SYS_fork]   =  sys_fork, */
     [SYS_exit]    = sys_exit,
+    [SYS_yield]   = sys_yield,
+    [SYS_fork]    = sys_fork,
+    [SYS_spawn]   = sys_spawn,
+    [SYS_mmap]    = sys_mmap,
+    [SYS_munmap]  = sys_munmap,
+    [SYS_shmget]  = sys_shmget,
+    [SYS_shmat]   = sys_shmat,
+    [SYS_shmdt]   = sys_shmdt,
+    [SYS_wait]    = sys_wait,
+    [SYS_zpool]   = sys_zpool,
 };
 
 void syscall_handler(struct interrupt_state *state) {
@@ -38,16 +57,22 @@ void syscall_handler(struct interrupt_state *state) {
 #define CDECL_ARG(p, n) (p) + sizeof(uint32_t)*(1 + (n))
 
 // Fetch the int at addr from the current process.
-static inline int
-fetchint(struct process *proc, int n, int32_t *ip)
+int
+fetchaddr(struct process *proc, uint32_t addr, int32_t *ip)
 {
-  uint32_t addr = CDECL_ARG(proc->tf->esp, n);
-  if(addr >= proc->sz || addr+4 > proc->sz)
+  if(!vma_check(proc, addr, 4, false))
     return -1;
   *ip = *(int32_t*)(addr);
   return 0;
 }
 
+// Fetch the n-th int argument on the user stack.
+static inline int
+fetchint(struct process *proc, int n, int32_t *ip)
+{
+  return fetchaddr(proc, CDECL_ARG(proc->tf->esp, n), ip);
+}
+
 // Fetch the nth 32-bit system call argument.
 int sysarg_get_int(struct process *proc, int n, int32_t *ip)
 {
@@ -56,13 +81,27 @@ int sysarg_get_int(struct process *proc, int n, int32_t *ip)
 
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size bytes.  Check that the pointer
-// lies within the process address space.
+// lies within the process address space areas.
 int sysarg_get_ptr(struct process *proc, int n, char **pp, size_t size)
 {
   int32_t i;
   if(fetchint(proc, n, &i) < 0)
     return -1;
-  if(size < 0 || (uint32_t)i >= proc->sz || (uint32_t)i+size > proc->sz)
+  if(!vma_check(proc, (uint32_t)i, size, false))
+    return -1;
+  *pp = (char*)i;
+  return 0;
+}
+
+// Same as sysarg_get_ptr() for a block the kernel writes results to, which
+// must lie in writable areas: a kernel write elsewhere can't be faulted in.
+// A null pointer is passed as is.
+int sysarg_get_outptr(struct process *proc, int n, char **pp, size_t size)
+{
+  int32_t i;
+  if(fetchint(proc, n, &i) < 0)
+    return -1;
+  if(i != 0 && !vma_check(proc, (uint32_t)i, size, true))
     return -1;
   *pp = (char*)i;
   return 0;
@@ -73,17 +112,23 @@ int sysarg_get_ptr(struct process *proc, int n, char **pp, size_t size)
 // Returns length of string, not including nul.
 int fetchstr(struct process *proc, uint32_t addr, char **pp)
 {
-  if(addr >= proc->sz)
+  struct vma *v = vma_find(proc, addr);
+  if(v == 0)
     return -1;
   *pp = (char*)addr;
-  char *ep = (char*)proc->sz;
-  for(char *s = *pp; s < ep; s++){
+  char *ep = (char*)v->end;
+  for(char *s = *pp; ; s++){
+    if(s == ep){
+      // The string may go on in an adjacent area.
+      if((v = vma_find(proc, (uint32_t)s)) == 0)
+        return -1;
+      ep = (char*)v->end;
+    }
     if(*s == '\0')
       {
       return s - *pp;
       }
   }
-  return -1;
 }
 
 // Fetch the nth word-sized system call argument as a string pointer.
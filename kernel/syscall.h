@@ -13,8 +13,11 @@
 
 void syscall_handler(struct interrupt_state *state);
 
+int fetchaddr(struct process *proc, uint32_t addr, int32_t *ip);
+int fetchstr(struct process *proc, uint32_t addr, char **pp);
 int sysarg_get_int(struct process *proc, int n, int32_t *ip);
 int sysarg_get_ptr(struct process *proc, int n, char **pp, size_t size);
+int sysarg_get_outptr(struct process *proc, int n, char **pp, size_t size);
 int sysarg_get_str(struct process *proc, int n, char **pp);
 
 #endif /* SYSCALL_H */
@@ -1,2 +1,12 @@
 %define SYS_hello   1
 %define SYS_exit    2
+%define SYS_yield   3
+%define SYS_fork    4
+%define SYS_spawn   5
+%define SYS_mmap    6
+%define SYS_munmap  7
+%define SYS_shmget  8
+%define SYS_shmat   9
+%define SYS_shmdt   10
+%define SYS_wait    11
+%define SYS_zpool   12
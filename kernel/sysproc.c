@@ -1,3 +1,6 @@
+#include "lib/utils.h"
+#include "kalloc.h"
+#include "shm.h"
 #include "syscall.h"
 
 int sys_exit(void) {
@@ -8,3 +11,116 @@ int sys_exit(void) {
     exit(n);
     return 0;  // not reached
 }
+
+int sys_wait(void) {
+    struct process *proc = myproc();
+    char *status;
+    if (sysarg_get_outptr(proc, 0, &status, sizeof(int32_t)) < 0)
+        return SYSFAIL;
+    return wait((int32_t*)status);
+}
+
+int sys_yield(void) {
+    yield();
+    return 0;
+}
+
+int sys_fork(void) {
+    return fork();
+}
+
+int sys_spawn(void) {
+    struct process *proc = myproc();
+    char *path, *argv[MAXARG + 1];
+    int32_t uargv, uarg;
+
+    if (sysarg_get_str(proc, 0, &path) < 0)
+        return SYSFAIL;
+    if (sysarg_get_int(proc, 1, &uargv) < 0)
+        return SYSFAIL;
+
+    for (uint32_t i = 0;; i++) {
+        if (i >= NELEM(argv))
+            return SYSFAIL;
+        if (fetchaddr(proc, uargv + 4 * i, &uarg) < 0)
+            return SYSFAIL;
+        if (uarg == 0) {
+            argv[i] = 0;
+            break;
+        }
+        if (fetchstr(proc, uarg, &argv[i]) < 0)
+            return SYSFAIL;
+    }
+
+    return spawn(path, argv);
+}
+
+int sys_mmap(void) {
+    struct process *proc = myproc();
+    int32_t addr, len, prot, flags, dev, off;
+
+    if (sysarg_get_int(proc, 0, &addr) < 0 ||
+        sysarg_get_int(proc, 1, &len) < 0 ||
+        sysarg_get_int(proc, 2, &prot) < 0 ||
+        sysarg_get_int(proc, 3, &flags) < 0 ||
+        sysarg_get_int(proc, 4, &dev) < 0 ||
+        sysarg_get_int(proc, 5, &off) < 0)
+        return SYSFAIL;
+
+    return vma_mmap(proc, addr, len, prot, flags, dev, off);
+}
+
+int sys_munmap(void) {
+    struct process *proc = myproc();
+    int32_t addr, len;
+
+    if (sysarg_get_int(proc, 0, &addr) < 0 ||
+        sysarg_get_int(proc, 1, &len) < 0)
+        return SYSFAIL;
+
+    return vma_munmap(proc, addr, len);
+}
+
+int sys_shmget(void) {
+    struct process *proc = myproc();
+    int32_t key, size;
+
+    if (sysarg_get_int(proc, 0, &key) < 0 ||
+        sysarg_get_int(proc, 1, &size) < 0)
+        return SYSFAIL;
+
+    return shm_get(key, size);
+}
+
+int sys_shmat(void) {
+    struct process *proc = myproc();
+    int32_t id, addr;
+
+    if (sysarg_get_int(proc, 0, &id) < 0 ||
+        sysarg_get_int(proc, 1, &addr) < 0)
+        return SYSFAIL;
+
+    return vma_shmat(proc, id, addr);
+}
+
+int sys_shmdt(void) {
+    struct process *proc = myproc();
+    int32_t addr;
+
+    if (sysarg_get_int(proc, 0, &addr) < 0)
+        return SYSFAIL;
+
+    return vma_shmdt(proc, addr);
+}
+
+// Set the high-water mark of the pool of zeroed frames. Returns the
+// previous one.
+int sys_zpool(void) {
+    struct process *proc = myproc();
+    int32_t high;
+
+    if (sysarg_get_int(proc, 0, &high) < 0 ||
+        high < 0 || high > ZPOOL_HIGH_MAX)
+        return SYSFAIL;
+    return kalloc_zeroed_set_high(high);
+}
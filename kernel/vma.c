@@ -0,0 +1,574 @@
+#include "drivers/ide.h"
+#include "drivers/screen.h"
+#include "fs/block.h"
+#include "lib/debug.h"
+#include "lib/string.h"
+#include "kalloc.h"
+#include "mman.h"
+#include "pagecache.h"
+#include "paging.h"
+#include "proc.h"
+#include "shm.h"
+#include "swap.h"
+
+#include "vma.h"
+
+struct vma_stats vma_stats;
+
+/** Pages mapped around a fault, see vma_fault_around(). */
+static uint32_t faultaround_pages = FAULTAROUND_DEFAULT;
+
+static const char *vma_names[] = {
+    [VMA_CODE]  = "code",
+    [VMA_DATA]  = "data",
+    [VMA_HEAP]  = "heap",
+    [VMA_STACK] = "stack",
+    [VMA_MMAP]  = "mmap",
+};
+
+// Record the area [start, end) in p. Nothing is mapped yet. Returns NULL if
+// the area overlaps an existing one or p has no room left.
+struct vma *
+vma_add(struct process *p, enum vma_kind kind, uint32_t start, uint32_t end,
+        uint32_t flags, const char *src, uint32_t srclen)
+{
+  struct vma *free = 0;
+
+  start = PGROUNDDOWN(start);
+  end = PGROUNDUP(end);
+  if(start >= end || end > KERNBASE || srclen > end - start)
+    return 0;
+
+  for(struct vma *v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(!(v->flags & VMA_USED)){
+      if(free == 0)
+        free = v;
+    } else if(start < v->end && v->start < end){
+      warn("vma_add: %s area overlaps %s", vma_names[kind],
+           vma_names[v->kind]);
+      return 0;
+    }
+  }
+  if(free == 0)
+    return 0;
+
+  memset(free, 0, sizeof(*free));
+  free->start = start;
+  free->end = end;
+  free->flags = flags | VMA_USED;
+  free->kind = kind;
+  free->src = src;
+  free->srclen = srclen;
+  return free;
+}
+
+// Area of p containing va, if any.
+struct vma *
+vma_find(struct process *p, uint32_t va)
+{
+  for(struct vma *v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if((v->flags & VMA_USED) && v->start <= va && va < v->end)
+      return v;
+  return 0;
+}
+
+// Whether [va, va+len) lies within areas of p, writable ones if write, e.g.
+// to validate system call arguments. Pages need not be mapped: kernel
+// accesses fault them in.
+bool
+vma_check(struct process *p, uint32_t va, uint32_t len, bool write)
+{
+  uint32_t end = va + len;
+  if(end < va)
+    return false;
+  while(va < end){
+    struct vma *v = vma_find(p, va);
+    if(v == 0 || (write && !(v->flags & VMA_WRITE)))
+      return false;
+    va = v->end;
+  }
+  return true;
+}
+
+// Map the device page backing a of v, from the page cache. Shared mappings
+// map the cached frame itself. Private ones map it copy-on-write, or get
+// their own copy right away on a write. With cheap, only pages already
+// cached are mapped.
+static int
+vma_map_dev(struct process *p, struct vma *v, uint32_t a, bool write,
+            bool cheap)
+{
+  uint32_t pgno = v->pgoff + (a - v->start) / PGSIZE;
+  char *mem = cheap ? pagecache_peek(v->dev, pgno) : pagecache_get(v->dev, pgno);
+  int perm = PTE_U;
+
+  if(mem == 0)
+    return -1;
+
+  if(v->flags & VMA_SHARED){
+    perm |= PTE_SHARED | ((v->flags & VMA_WRITE) ? PTE_W : 0);
+  } else if(write){
+    char *copy = kalloc();
+    if(copy == 0){
+      kref_put(mem);
+      return -1;
+    }
+    memmove(copy, mem, PGSIZE);
+    kref_put(mem);
+    frame_info(V2P(copy))->ref = 1;
+    mem = copy;
+    perm |= PTE_W;
+  } else if(v->flags & VMA_WRITE){
+    perm |= PTE_COW;
+  }
+
+  if(mappages(p->pgdir, a, PGSIZE, V2P(mem), perm) < 0){
+    kref_put(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Map the page of v's shared memory segment at a, allocating it unless cheap.
+static int
+vma_map_shm(struct process *p, struct vma *v, uint32_t a, bool cheap)
+{
+  char *mem = shm_page(v->shm, v->pgoff + (a - v->start) / PGSIZE, !cheap);
+  if(mem == 0)
+    return -1;
+  if(mappages(p->pgdir, a, PGSIZE, V2P(mem), PTE_U|PTE_W|PTE_SHARED) < 0){
+    kref_put(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Map the image page backing a of read-only v. Such pages never change, so
+// every process running the image maps the same frame, from the page cache.
+static int
+vma_map_image(struct process *p, struct vma *v, uint32_t a)
+{
+  uint32_t off = a - v->start;
+  uint32_t n = v->srclen - off;
+  char *mem = pagecache_get_image(v->src + off, n > PGSIZE ? PGSIZE : n);
+
+  if(mem == 0)
+    return -1;
+  if(mappages(p->pgdir, a, PGSIZE, V2P(mem), PTE_U) < 0){
+    kref_put(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Map a frame at the non-present page a of v, filled from the area's image or
+// device, or zeroed. With cheap, give up rather than read the disk or zero a
+// frame on the spot.
+static int
+vma_map(struct process *p, struct vma *v, uint32_t a, bool write, bool cheap)
+{
+  uint32_t off = a - v->start;
+  int perm = PTE_U | ((v->flags & VMA_WRITE) ? PTE_W : 0);
+  char *mem;
+
+  if(v->flags & VMA_DEV)
+    return vma_map_dev(p, v, a, write, cheap);
+  if(v->flags & VMA_SHM)
+    return vma_map_shm(p, v, a, cheap);
+  if(off < v->srclen && !(v->flags & VMA_WRITE))
+    return vma_map_image(p, v, a);
+
+  if(off < v->srclen){
+    uint32_t n = v->srclen - off;
+    if(n > PGSIZE)
+      n = PGSIZE;
+    if((mem = kalloc()) == 0)
+      return -1;
+    memmove(mem, v->src + off, n);
+    memset(mem + n, 0, PGSIZE - n);
+  } else if((mem = cheap ? kalloc_zeroed_pooled() : kalloc_zeroed()) == 0){
+    return -1;
+  }
+
+  if(mappages(p->pgdir, a, PGSIZE, V2P(mem), perm) < 0){
+    kfree(mem);
+    return -1;
+  }
+  frame_info(V2P(mem))->ref = 1;
+  return 0;
+}
+
+/**
+ * Map pages around the fault at a, to spare the traps a scan would take on
+ * each of them.
+ *
+ * By default the aligned window of faultaround_pages containing a is mapped,
+ * only with pages that are cheap to get: cached device pages, image pages,
+ * pre-zeroed frames. When faults follow each other in v (a is right after the
+ * last fault or its window), the access is deemed sequential: pages ahead of
+ * a are mapped whatever their cost, over a window doubling at each such
+ * fault, up to FAULTAROUND_MAX.
+ */
+static void
+vma_fault_around(struct process *p, struct vma *v, uint32_t a)
+{
+  uint32_t start, end;
+  bool cheap;
+
+  if(faultaround_pages <= 1)
+    return;
+
+  if(a == v->next || a == v->last + PGSIZE){
+    if(v->ra == 0)
+      v->ra = faultaround_pages;
+    else if(v->ra < FAULTAROUND_MAX)
+      v->ra *= 2;
+    start = a + PGSIZE;
+    end = a + v->ra * PGSIZE;
+    cheap = false;
+    vma_stats.sequential++;
+  } else {
+    uint32_t w = faultaround_pages * PGSIZE;
+    v->ra = 0;
+    start = a - (a - v->start) % w;
+    end = start + w;
+    cheap = true;
+  }
+  if(end > v->end || end < start)
+    end = v->end;
+
+  for(uint32_t va = start; va < end; va += PGSIZE){
+    if(va == a)
+      continue;
+    pte_t *pte = walkpgdir(p->pgdir, va, false);
+    if(pte && (*pte & (PTE_P|PTE_SWAP)))
+      continue;
+    if(vma_map(p, v, va, false, cheap) == 0)
+      vma_stats.pages_prefaulted++;
+    else if(!cheap)
+      break;  // out of memory
+  }
+
+  v->last = a;
+  v->next = end;
+}
+
+/**
+ * Replace the page table covering a by a single 4MiB page, once the 4MiB
+ * aligned region it maps lies within v and is fully populated with private
+ * pages. Their content moves to a block from the buddy allocator; if there is
+ * none, the small pages simply stay. Huge pages are split back whenever part
+ * of them is unmapped or shared by fork(), see hugepage_split().
+ */
+static void
+vma_huge(struct process *p, struct vma *v, uint32_t a)
+{
+  uint32_t base = HPGROUNDDOWN(a);
+  if((v->flags & (VMA_DEV|VMA_SHM)) || base < v->start ||
+     base + HPGSIZE > v->end || base + HPGSIZE < base)
+    return;
+
+  pde_t *pde = &p->pgdir[PDX(base)];
+  if((*pde & (PTE_P|PTE_PS)) != PTE_P)
+    return;
+  pte_t *pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
+  // Backwards: holes are most likely ahead of a sequential scan.
+  for(int i = NPTENTRIES - 1; i >= 0; i--){
+    if((pgtab[i] & (PTE_P|PTE_U|PTE_W|PTE_COW|PTE_SHARED)) !=
+       (PTE_P|PTE_U|PTE_W))
+      return;
+    if(frame_info(PTE_ADDR(pgtab[i]))->ref != 1)
+      return;
+  }
+
+  char *huge = kalloc_pages(HPGORDER);
+  if(huge == 0){
+    p->hugestats.fallbacks++;
+    return;
+  }
+  for(uint32_t i = 0; i < NPTENTRIES; i++)
+    memmove(huge + i * PGSIZE, P2V(PTE_ADDR(pgtab[i])), PGSIZE);
+  frame_info(V2P(huge))->ref = 1;
+
+  *pde = V2P(huge) | PTE_PS | PTE_P | PTE_U | PTE_W;
+  tlb_flush_pgdir(p->pgdir);
+
+  for(uint32_t i = 0; i < NPTENTRIES; i++)
+    kref_put(P2V(PTE_ADDR(pgtab[i])));
+  kfree((char*)pgtab);
+  p->hugestats.promoted++;
+}
+
+// Resolve a fault at va. A non-present page gets a frame filled from the
+// area's image or device, or zeroed, and so do some of its neighbours (see
+// vma_fault_around()), unless it was swapped out, in which case it is read
+// back alone. A write to a present page of a writable area can
+// only be copy-on-write. Returns -1 if va is outside p's areas or the access
+// isn't allowed, in which case the caller should kill p.
+int
+vma_fault(struct process *p, uint32_t va, bool write, bool present)
+{
+  struct vma *v = vma_find(p, va);
+  if(v == 0 || (write && !(v->flags & VMA_WRITE)))
+    return -1;
+  if(present)
+    return write ? cowpage(p->pgdir, va) : -1;
+
+  uint32_t a = PGROUNDDOWN(va);
+  pte_t *pte = walkpgdir(p->pgdir, a, false);
+  if(pte && (*pte & PTE_SWAP))
+    return swap_in(p->pgdir, a);
+
+  if(vma_map(p, v, a, write, false) < 0)
+    return -1;
+  vma_stats.faults++;
+
+  vma_fault_around(p, v, a);
+  vma_huge(p, v, a);
+  return 0;
+}
+
+// Number of huge pages mapped by p.
+uint32_t
+vma_huge_pages(struct process *p)
+{
+  uint32_t n = 0;
+  for(uint32_t i = 0; i < PDX(KERNBASE); i++)
+    if((p->pgdir[i] & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS))
+      n++;
+  return n;
+}
+
+void vma_dump(struct process *p) {
+    cprintf("process %d (%s): huge pages=%d promoted=%d fallbacks=%d\n",
+            p->pid, p->name, vma_huge_pages(p), p->hugestats.promoted,
+            p->hugestats.fallbacks);
+    for(struct vma *v = p->vmas; v < &p->vmas[NVMA]; v++)
+        if(v->flags & VMA_USED)
+            cprintf("  %s 0x%x-0x%x flags=0x%x\n", vma_names[v->kind],
+                    v->start, v->end, v->flags);
+}
+
+// Set the number of pages mapped around a fault, 1 to disable fault-around.
+void
+vma_set_faultaround(uint32_t pages)
+{
+  if(pages == 0)
+    pages = 1;
+  if(pages > FAULTAROUND_MAX)
+    pages = FAULTAROUND_MAX;
+  faultaround_pages = pages;
+}
+
+void vma_dump_stats(void) {
+    cprintf("vma: faults=%d prefaulted=%d sequential=%d window=%d\n",
+            vma_stats.faults, vma_stats.pages_prefaulted, vma_stats.sequential,
+            faultaround_pages);
+}
+
+// First address range of len bytes free of areas from hint on, aligned on
+// align (a power of 2), or 0.
+static uint32_t
+vma_free_range(struct process *p, uint32_t hint, uint32_t len, uint32_t align)
+{
+  uint32_t a = hint;
+  while((a = (a + align - 1) & ~(align - 1)) >= hint &&
+        a + len > a && a + len <= USTACKTOP - USTACKSIZE){
+    struct vma *next = 0;
+    for(struct vma *v = p->vmas; v < &p->vmas[NVMA]; v++)
+      if((v->flags & VMA_USED) && a < v->end && v->start < a + len)
+        if(next == 0 || v->end > next->end)
+          next = v;
+    if(next == 0)
+      return a;
+    a = next->end;
+  }
+  return 0;
+}
+
+/**
+ * Map len bytes, zero-filled (MAP_ANONYMOUS) or from device dev at byte
+ * offset off, at addr if free or anywhere above MMAPBASE otherwise. Pages are
+ * only populated on fault. Device pages come from the page cache: MAP_SHARED
+ * mappings use the cached frames directly and get written back by
+ * vma_munmap(), MAP_PRIVATE ones copy them on first write.
+ *
+ * Returns the mapping address, or (uint32_t)MAP_FAILED.
+ */
+uint32_t
+vma_mmap(struct process *p, uint32_t addr, uint32_t len, int prot, int flags,
+         uint32_t dev, uint32_t off)
+{
+  const uint32_t failed = (uint32_t)MAP_FAILED;
+  bool shared = flags & MAP_SHARED;
+
+  if(len == 0 || len > KERNBASE || shared == !!(flags & MAP_PRIVATE))
+    return failed;
+  len = PGROUNDUP(len);
+
+  uint32_t vflags = (prot & PROT_WRITE) ? VMA_WRITE : 0;
+  if(flags & MAP_ANONYMOUS){
+    // Shared anonymous memory would need an object outliving mappings.
+    if(shared)
+      return failed;
+  } else {
+    if(dev >= IDE_NDEV || off % PGSIZE ||
+       off + len < off || off + len > FSSIZE * BLOCK_SIZE)
+      return failed;
+    vflags |= VMA_DEV | (shared ? VMA_SHARED : 0);
+  }
+
+  // Large anonymous mappings are placed for huge pages, see vma_huge().
+  uint32_t align = PGSIZE;
+  if((flags & MAP_ANONYMOUS) && len >= HPGSIZE)
+    align = HPGSIZE;
+
+  addr = PGROUNDDOWN(addr);
+  if(addr == 0 || vma_free_range(p, addr, len, PGSIZE) != addr)
+    addr = vma_free_range(p, MMAPBASE, len, align);
+  if(addr == 0)
+    return failed;
+
+  struct vma *v = vma_add(p, VMA_MMAP, addr, addr + len, vflags, NULL, 0);
+  if(v == 0)
+    return failed;
+  v->dev = dev;
+  v->pgoff = off / PGSIZE;
+  return addr;
+}
+
+// Unmap the pages of v in [start, end), writing back those of a shared
+// device mapping that were modified.
+static void
+vma_unmap_pages(struct process *p, struct vma *v, uint32_t start, uint32_t end)
+{
+  if((v->flags & (VMA_DEV|VMA_SHARED)) == (VMA_DEV|VMA_SHARED)){
+    for(uint32_t a = start; a < end; a += PGSIZE){
+      pte_t *pte = walkpgdir(p->pgdir, a, false);
+      if(pte && (*pte & (PTE_P|PTE_D)) == (PTE_P|PTE_D))
+        pagecache_sync(v->dev, v->pgoff + (a - v->start) / PGSIZE);
+    }
+  }
+  deallocuvm(p->pgdir, end, start);
+}
+
+// Make v start at start instead, within v.
+static void
+vma_trim_front(struct vma *v, uint32_t start)
+{
+  uint32_t delta = start - v->start;
+  v->start = start;
+  if(v->src){
+    v->src += delta;
+    v->srclen = v->srclen > delta ? v->srclen - delta : 0;
+  }
+  v->pgoff += delta / PGSIZE;
+}
+
+/**
+ * Remove [addr, addr+len) from p's address space, whatever the areas it
+ * covers. An area may be shrunk or split. Returns -1 on bad arguments or if
+ * there is no room for splitting.
+ */
+int
+vma_munmap(struct process *p, uint32_t addr, uint32_t len)
+{
+  if(addr % PGSIZE || len == 0)
+    return -1;
+  uint32_t end = PGROUNDUP(addr + len);
+  if(end <= addr || end > KERNBASE)
+    return -1;
+
+  // Only an area strictly containing the range needs splitting.
+  struct vma *v = vma_find(p, addr);
+  struct vma *split = 0;
+  if(v && v->start < addr && end < v->end){
+    for(split = p->vmas; split < &p->vmas[NVMA]; split++)
+      if(!(split->flags & VMA_USED))
+        break;
+    if(split == &p->vmas[NVMA])
+      return -1;
+  }
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++){
+    if(!(v->flags & VMA_USED) || end <= v->start || v->end <= addr)
+      continue;
+    uint32_t s = addr > v->start ? addr : v->start;
+    uint32_t e = end < v->end ? end : v->end;
+    vma_unmap_pages(p, v, s, e);
+
+    if(s == v->start && e == v->end){
+      if(v->flags & VMA_SHM)
+        shm_release(v->shm);
+      v->flags = 0;
+    } else if(s == v->start){
+      vma_trim_front(v, e);
+    } else if(e == v->end){
+      v->end = s;
+    } else {
+      *split = *v;
+      vma_trim_front(split, e);
+      v->end = s;
+      if(v->flags & VMA_SHM)
+        shm_dup(v->shm);
+    }
+  }
+
+  tlb_flush_pgdir(p->pgdir);
+  return 0;
+}
+
+/**
+ * Attach shared memory segment id at addr if free, anywhere above MMAPBASE
+ * otherwise. Returns the attachment address, or (uint32_t)MAP_FAILED.
+ */
+uint32_t
+vma_shmat(struct process *p, int id, uint32_t addr)
+{
+  struct shm *s = shm_hold(id);
+  if(s == 0)
+    return (uint32_t)MAP_FAILED;
+
+  uint32_t len = s->npages * PGSIZE;
+  addr = PGROUNDDOWN(addr);
+  if(addr == 0 || vma_free_range(p, addr, len, PGSIZE) != addr)
+    addr = vma_free_range(p, MMAPBASE, len, PGSIZE);
+
+  struct vma *v;
+  if(addr == 0 ||
+     (v = vma_add(p, VMA_MMAP, addr, addr + len, VMA_WRITE|VMA_SHM,
+                  NULL, 0)) == 0){
+    shm_release(s);
+    return (uint32_t)MAP_FAILED;
+  }
+  v->shm = s;
+  return addr;
+}
+
+// Detach the shared memory segment attached at addr.
+int
+vma_shmdt(struct process *p, uint32_t addr)
+{
+  struct vma *v = vma_find(p, addr);
+  if(v == 0 || !(v->flags & VMA_SHM) || v->start != addr)
+    return -1;
+  return vma_munmap(p, v->start, v->end - v->start);
+}
+
+// Give child np the areas of p, for fork().
+void
+vma_fork(struct process *np, struct process *p)
+{
+  memmove(np->vmas, p->vmas, sizeof(np->vmas));
+  for(struct vma *v = np->vmas; v < &np->vmas[NVMA]; v++)
+    if((v->flags & (VMA_USED|VMA_SHM)) == (VMA_USED|VMA_SHM))
+      shm_dup(v->shm);
+}
+
+// Unmap all areas of p, e.g. on exit. Shared pages are written back and
+// shared memory segments detached.
+void
+vma_release(struct process *p)
+{
+  vma_munmap(p, 0, KERNBASE);
+}
@@ -0,0 +1,101 @@
+/**
+ * Virtual memory areas of user processes.
+ *
+ * A process address space is described by a few areas (code, data, heap,
+ * stack) rather than by its page tables. Pages are only mapped on first touch
+ * by the page fault handler: either zero-filled, or filled from the backing
+ * image for the part of the area that has one. Image pages of read-only
+ * areas are shared by all processes running the image.
+ */
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "paging.h"
+
+/** Max number of areas per process. */
+#define NVMA 16
+
+/** User address space layout. Reserved ranges only cost the pages touched. */
+#define USTACKTOP   KERNBASE
+#define USTACKSIZE  (256 * PGSIZE)          // 1MiB
+#define UHEAPSIZE   (4 * 1024 * 1024)
+#define MMAPBASE    0x40000000              // mmap() areas go from there
+
+/** Pages mapped around a fault, and max window for sequential accesses. */
+#define FAULTAROUND_DEFAULT 16
+#define FAULTAROUND_MAX     64
+
+/** Area flags. */
+#define VMA_USED    0x1
+#define VMA_WRITE   0x2
+#define VMA_DEV     0x4     // backed by pages of a block device
+#define VMA_SHARED  0x8     // writes are seen by all mappings and the device
+#define VMA_SHM     0x10    // attached shared memory segment
+
+enum vma_kind {
+    VMA_CODE,
+    VMA_DATA,
+    VMA_HEAP,
+    VMA_STACK,
+    VMA_MMAP,
+};
+
+struct vma {
+    uint32_t      start;    /** First address, page aligned. */
+    uint32_t      end;      /** Past the last address, page aligned. */
+    uint32_t      flags;
+    enum vma_kind kind;
+    const char   *src;      /** Backing image, copied at start, or NULL. */
+    uint32_t      srclen;   /** Image bytes, the rest of the area is zero. */
+    uint32_t      dev;      /** With VMA_DEV: device number, */
+    uint32_t      pgoff;    /** and page index of start on the device. */
+    struct shm   *shm;      /** With VMA_SHM: the segment, from page pgoff. */
+
+    // Fault pattern, see vma_fault_around().
+    uint32_t      last;     /** Page of the last fault. */
+    uint32_t      next;     /** End of the window mapped at the last fault. */
+    uint32_t      ra;       /** Pages mapped ahead of sequential faults. */
+};
+
+/** Fault path counters. */
+struct vma_stats {
+    uint32_t faults;          /** Faults resolved by mapping a page. */
+    uint32_t pages_prefaulted;/** Pages mapped around faults, sparing a
+                                  trap if ever touched, which isn't
+                                  tracked: an upper bound on traps saved. */
+    uint32_t sequential;      /** Faults found to follow a sequential scan. */
+};
+
+extern struct vma_stats vma_stats;
+
+/** Per-process huge page counters, see vma_huge(). */
+struct vma_hugestats {
+    uint32_t promoted;      /** Regions moved to a huge page. */
+    uint32_t fallbacks;     /** Promotions given up for lack of a 4MiB block. */
+};
+
+struct process;
+struct shm;
+
+struct vma *vma_add(struct process *p, enum vma_kind kind, uint32_t start,
+                    uint32_t end, uint32_t flags, const char *src,
+                    uint32_t srclen);
+struct vma *vma_find(struct process *p, uint32_t va);
+bool vma_check(struct process *p, uint32_t va, uint32_t len, bool write);
+int vma_fault(struct process *p, uint32_t va, bool write, bool present);
+uint32_t vma_mmap(struct process *p, uint32_t addr, uint32_t len, int prot,
+                  int flags, uint32_t dev, uint32_t off);
+int vma_munmap(struct process *p, uint32_t addr, uint32_t len);
+uint32_t vma_shmat(struct process *p, int id, uint32_t addr);
+int vma_shmdt(struct process *p, uint32_t addr);
+void vma_fork(struct process *np, struct process *p);
+void vma_release(struct process *p);
+uint32_t vma_huge_pages(struct process *p);
+void vma_dump(struct process *p);
+void vma_set_faultaround(uint32_t pages);
+void vma_dump_stats(void);
+
+#endif /* VMA_H */
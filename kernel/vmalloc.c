@@ -0,0 +1,242 @@
+#include "drivers/screen.h"
+#include "lib/debug.h"
+#include "lib/string.h"
+#include "cpu.h"
+#include "kalloc.h"
+#include "slab.h"
+#include "spinlock.h"
+
+#include "vmalloc.h"
+
+struct vmalloc_stats vmalloc_stats;
+
+// A range of the region, guard page excluded.
+struct vm_area {
+  uint32_t        start;
+  uint32_t        npages;
+  bool            lazy;     // freed, waiting for the next purge
+  struct vm_area *next;     // sorted by start
+};
+
+static struct {
+  struct spinlock lock;
+  struct vm_area *areas;
+  struct kmem_cache *cache;
+  uint32_t lazy_pages;
+  char *lazy_frames;        // frames of lazy areas, chained by first word
+} vmap;
+
+// Lowest free range of npages plus a guard page, or 0. Must hold vmap.lock.
+static uint32_t
+vmalloc_find(uint32_t npages, struct vm_area ***link)
+{
+  uint32_t start = VMALLOC_START;
+  uint32_t size = (npages + 1) * PGSIZE;
+  struct vm_area **pp;
+
+  for(pp = &vmap.areas; *pp; pp = &(*pp)->next){
+    if((*pp)->start - start >= size)
+      break;
+    start = (*pp)->start + ((*pp)->npages + 1) * PGSIZE;
+  }
+  if(VMALLOC_END - start < size)
+    return 0;
+  *link = pp;
+  return start;
+}
+
+// Release the ranges of freed areas and their frames, after flushing the TLB
+// of them all at once: page by page, or entirely past VMALLOC_LAZY_MAX pages
+// where that gets cheaper. Other cpus may have cached them too, then all
+// TLBs are flushed. Must hold vmap.lock.
+static void
+vmalloc_purge(void)
+{
+  bool all = vmap.lazy_pages > VMALLOC_LAZY_MAX || ncpu > 1;
+
+  for(struct vm_area **pp = &vmap.areas; *pp; ){
+    struct vm_area *a = *pp;
+    if(!a->lazy){
+      pp = &a->next;
+      continue;
+    }
+    if(!all)
+      for(uint32_t i = 0; i < a->npages; i++)
+        tlb_flush_page(a->start + i * PGSIZE);
+    *pp = a->next;
+    kmem_cache_free(vmap.cache, a);
+  }
+  if(all)
+    tlb_shootdown();
+
+  while(vmap.lazy_frames){
+    char *f = vmap.lazy_frames;
+    vmap.lazy_frames = *(char**)f;
+    kfree(f);
+  }
+  vmap.lazy_pages = 0;
+  vmalloc_stats.purges++;
+}
+
+// Unmap the pages of area a, keeping their frames for the next purge. Must
+// hold vmap.lock.
+static void
+vmalloc_unmap(struct vm_area *a)
+{
+  for(uint32_t i = 0; i < a->npages; i++){
+    pte_t *pte = walkpgdir(kpgdir, a->start + i * PGSIZE, false);
+    if(pte == 0 || !(*pte & PTE_P))
+      continue;
+    char *f = P2V(PTE_ADDR(*pte));
+    *pte = 0;
+    *(char**)f = vmap.lazy_frames;
+    vmap.lazy_frames = f;
+    vmalloc_stats.pages--;
+  }
+  a->lazy = true;
+  vmap.lazy_pages += a->npages;
+}
+
+/**
+ * Allocate size bytes, page aligned, of virtually contiguous memory. Frames
+ * are allocated one by one, so that this works as long as there are enough
+ * free frames, however scattered. Each allocation is followed by an unmapped
+ * guard page. Returns 0 on lack of memory or address space.
+ */
+void *
+vmalloc(size_t size)
+{
+  if(size == 0 || size > VMALLOC_END - VMALLOC_START)
+    return 0;
+  uint32_t npages = PGROUNDUP(size) / PGSIZE;
+
+  struct vm_area *a = kmem_cache_alloc(vmap.cache);
+  if(a == 0)
+    return 0;
+
+  acquire(&vmap.lock);
+  struct vm_area **link;
+  uint32_t start = vmalloc_find(npages, &link);
+  if(start == 0 && vmap.lazy_pages){
+    vmalloc_purge();
+    start = vmalloc_find(npages, &link);
+  }
+  if(start == 0){
+    release(&vmap.lock);
+    kmem_cache_free(vmap.cache, a);
+    return 0;
+  }
+  a->start = start;
+  a->npages = npages;
+  a->lazy = false;
+  a->next = *link;
+  *link = a;
+  release(&vmap.lock);
+
+  // Outside the lock, so that kalloc() may reclaim memory.
+  for(uint32_t i = 0; i < npages; i++){
+    char *mem = kalloc();
+    acquire(&vmap.lock);
+    if(mem == 0 || mappages(kpgdir, start + i * PGSIZE, PGSIZE, V2P(mem),
+                            PTE_W | kpte_global) < 0){
+      if(mem)
+        kfree(mem);
+      vmalloc_unmap(a);
+      release(&vmap.lock);
+      return 0;
+    }
+    vmalloc_stats.pages++;
+    release(&vmap.lock);
+  }
+
+  vmalloc_stats.allocs++;
+  return (void*)start;
+}
+
+// Free memory from vmalloc().
+void
+vfree(void *addr)
+{
+  if(addr == 0)
+    return;
+
+  acquire(&vmap.lock);
+  struct vm_area *a = vmap.areas;
+  while(a && a->start != (uint32_t)addr)
+    a = a->next;
+  if(a == 0 || a->lazy)
+    panic("vfree");
+  vmalloc_unmap(a);
+  vmalloc_stats.frees++;
+  if(vmap.lazy_pages >= VMALLOC_LAZY_MAX)
+    vmalloc_purge();
+  release(&vmap.lock);
+}
+
+// kmalloc() for up to a page, vmalloc() beyond, e.g. for tables whose size
+// isn't known in advance.
+void *
+kvmalloc(size_t size)
+{
+  return size <= PGSIZE ? kmalloc(size) : vmalloc(size);
+}
+
+void
+kvfree(void *addr)
+{
+  if((uint32_t)addr >= VMALLOC_START && (uint32_t)addr < VMALLOC_END)
+    vfree(addr);
+  else
+    kmfree(addr);
+}
+
+/**
+ * Resolve a kernel fault at va in the vmalloc() region, when the page table
+ * covering it was created after the current page directory: link it from
+ * kpgdir. Page tables of the region are never freed, so that the link stays
+ * valid. Returns -1 if va isn't mapped in kpgdir either.
+ */
+int
+vmalloc_fault(uint32_t va)
+{
+  pde_t *pgdir = P2V(rcr3());
+  pde_t pde = kpgdir[PDX(va)];
+
+  if(va < VMALLOC_START || va >= VMALLOC_END || pgdir == kpgdir ||
+     !(pde & PTE_P) || (pgdir[PDX(va)] & PTE_P))
+    return -1;
+  pgdir[PDX(va)] = pde;
+  vmalloc_stats.pde_syncs++;
+  return 0;
+}
+
+void vmalloc_dump(void) {
+    cprintf("vmalloc: allocs=%d frees=%d pages=%d lazy=%d purges=%d "
+            "pde syncs=%d\n", vmalloc_stats.allocs, vmalloc_stats.frees,
+            vmalloc_stats.pages, vmap.lazy_pages, vmalloc_stats.purges,
+            vmalloc_stats.pde_syncs);
+}
+
+// Anything kvm_init() mapped in the region, e.g. ACPI tables above the
+// direct map, is kept out of reach.
+void vmalloc_init(void) {
+    initlock(&vmap.lock, "vmalloc");
+    vmap.cache = kmem_cache_create("vm_area", sizeof(struct vm_area), 0, 0, 0);
+    if(vmap.cache == 0)
+        panic("vmalloc_init");
+
+    struct vm_area **link = &vmap.areas;
+    for(uint32_t va = VMALLOC_START; va < VMALLOC_END; va += HPGSIZE){
+        if(!(kpgdir[PDX(va)] & PTE_P))
+            continue;
+        struct vm_area *a = kmem_cache_alloc(vmap.cache);
+        if(a == 0)
+            panic("vmalloc_init");
+        a->start = va;
+        a->npages = HPGSIZE / PGSIZE - 1;   // the guard page ends it
+        a->lazy = false;
+        a->next = 0;
+        *link = a;
+        link = &a->next;
+    }
+}
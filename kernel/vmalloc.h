@@ -0,0 +1,40 @@
+/**
+ * Virtually contiguous kernel allocations, for buffers too large to ask the
+ * buddy allocator for physically contiguous frames. vmalloc() maps scattered
+ * frames into a region of the kernel half above the direct map.
+ *
+ * Page tables of the region are only created in kpgdir: other page
+ * directories pick them up on first fault, see vmalloc_fault(). Freed ranges
+ * are unmapped right away but only reused once enough of them piled up to
+ * flush their TLB entries in one go, frames being released then.
+ */
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "paging.h"
+
+/** Pages freed before their TLB entries get flushed. */
+#define VMALLOC_LAZY_MAX    32
+
+struct vmalloc_stats {
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t pages;         /** Pages currently mapped. */
+    uint32_t purges;        /** Batched flushes of freed ranges. */
+    uint32_t pde_syncs;     /** Page tables linked lazily on fault. */
+};
+
+extern struct vmalloc_stats vmalloc_stats;
+
+void vmalloc_init(void);
+void *vmalloc(size_t size);
+void vfree(void *addr);
+void *kvmalloc(size_t size);
+void kvfree(void *addr);
+int vmalloc_fault(uint32_t va);
+void vmalloc_dump(void);
+
+#endif /* VMALLOC_H */
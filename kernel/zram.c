@@ -0,0 +1,191 @@
+#include "drivers/screen.h"
+#include "lib/debug.h"
+#include "lib/lz4.h"
+#include "lib/string.h"
+#include "kalloc.h"
+#include "low_level.h"
+#include "slab.h"
+#include "spinlock.h"
+
+#include "zram.h"
+
+struct zram_stats zram_stats;
+
+struct zram_slot {
+  char    *data;    // compressed page, from kmalloc()
+  uint16_t len;
+  uint8_t  ref;     // swap entries referring to the slot, 0 when free
+};
+
+static struct {
+  struct spinlock lock;
+  struct zram_slot slots[ZRAM_NSLOTS];
+  uint32_t hint;            // where to look for a free slot next
+  uint32_t used;
+  uint32_t bytes;           // compressed bytes held
+  char *reserve[ZRAM_RESERVE];  // free frames, see zram_store()
+  uint32_t nreserve;
+  char buf[ZRAM_MAX_CSIZE];
+  char work[LZ4_WORK_SIZE];
+} zram;
+
+// Latency histogram bucket of cycles.
+static uint32_t
+zram_bucket(uint64_t cycles)
+{
+  uint32_t b = 0;
+  for(cycles >>= ZRAM_HIST_CYCLES_SHIFT; cycles && b < ZRAM_HIST - 1; cycles >>= 1)
+    b++;
+  return b;
+}
+
+// Free slot index, or -1. Must hold zram.lock.
+static int32_t
+zram_slot_alloc(void)
+{
+  for(uint32_t n = 0; n < ZRAM_NSLOTS; n++){
+    uint32_t i = (zram.hint + n) % ZRAM_NSLOTS;
+    if(zram.slots[i].ref == 0){
+      zram.hint = i + 1;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Compress page into the pool. Returns its slot, or -1 if the page is left
+// for the disk. Allocates nothing but the compressed block, and never
+// reclaims to get it: called on the reclaim path. Reserved frames are given
+// back to the allocator instead, see zram_refill().
+int32_t
+zram_store(const char *page)
+{
+  int32_t idx = -1;
+
+  acquire(&zram.lock);
+  uint64_t t = rdtsc();
+  uint32_t len = lz4_compress(page, PGSIZE, zram.buf, sizeof(zram.buf),
+                              zram.work);
+  zram_stats.compress_hist[zram_bucket(rdtsc() - t)]++;
+  if(len == 0){
+    zram_stats.incompressible++;
+    goto out;
+  }
+
+  char *data = 0;
+  if(zram.bytes + len <= ZRAM_MAX_BYTES && (idx = zram_slot_alloc()) >= 0)
+    while((data = kmalloc(len)) == 0 && zram.nreserve > 0)
+      kfree_pages(zram.reserve[--zram.nreserve], 0);
+  if(data == 0){
+    zram_stats.full++;
+    idx = -1;
+    goto out;
+  }
+  memmove(data, zram.buf, len);
+  zram.slots[idx].data = data;
+  zram.slots[idx].len = len;
+  zram.slots[idx].ref = 1;
+  zram.used++;
+  zram.bytes += len;
+  zram_stats.stores++;
+  zram_stats.size_hist[len * ZRAM_HIST / PGSIZE]++;
+
+ out:
+  release(&zram.lock);
+  return idx;
+}
+
+// Decompress slot idx into page. The slot stays, see zram_put().
+void
+zram_load(uint32_t idx, char *page)
+{
+  if(idx >= ZRAM_NSLOTS)
+    panic("zram_load");
+  acquire(&zram.lock);
+  struct zram_slot *s = &zram.slots[idx];
+  if(s->ref == 0)
+    panic("zram_load");
+  uint64_t t = rdtsc();
+  if(lz4_decompress(s->data, s->len, page, PGSIZE) != PGSIZE)
+    panic("zram_load: corrupted page");
+  zram_stats.decompress_hist[zram_bucket(rdtsc() - t)]++;
+  zram_stats.loads++;
+  release(&zram.lock);
+}
+
+// One more swap entry refers to slot idx, e.g. after fork().
+void
+zram_dup(uint32_t idx)
+{
+  acquire(&zram.lock);
+  if(idx >= ZRAM_NSLOTS || zram.slots[idx].ref == 0 ||
+     zram.slots[idx].ref == 0xFF)
+    panic("zram_dup");
+  zram.slots[idx].ref++;
+  release(&zram.lock);
+}
+
+// Drop a reference to slot idx, freeing it with the last one.
+void
+zram_put(uint32_t idx)
+{
+  if(idx >= ZRAM_NSLOTS)
+    panic("zram_put");
+  acquire(&zram.lock);
+  struct zram_slot *s = &zram.slots[idx];
+  if(s->ref == 0)
+    panic("zram_put");
+  if(--s->ref == 0){
+    kmfree(s->data);
+    zram.bytes -= s->len;
+    zram.used--;
+    s->data = 0;
+  }
+  release(&zram.lock);
+}
+
+// Top up the reserve of frames for compressed blocks, from those just freed
+// by reclaim. Under zram.lock, kalloc() doesn't reclaim more.
+void
+zram_refill(void)
+{
+  char *f;
+
+  acquire(&zram.lock);
+  while(zram.nreserve < ZRAM_RESERVE && (f = kalloc()) != 0)
+    zram.reserve[zram.nreserve++] = f;
+  release(&zram.lock);
+}
+
+static void
+zram_dump_hist(const char *name, uint32_t *hist)
+{
+  cprintf("  %s:", name);
+  for(uint32_t i = 0; i < ZRAM_HIST; i++)
+    cprintf(" %d", hist[i]);
+  cprintf("\n");
+}
+
+/**
+ * Print pool usage and histograms. Ratio is original over compressed size,
+ * in percent. Size buckets are 1/8th of a page wide; latency ones double from
+ * 2^ZRAM_HIST_CYCLES_SHIFT cycles, the last one taking the rest.
+ */
+void zram_dump(void) {
+    acquire(&zram.lock);
+    cprintf("zram: pages=%d bytes=%d ratio=%d%% stores=%d loads=%d "
+            "incompressible=%d full=%d\n",
+            zram.used, zram.bytes,
+            zram.bytes ? zram.used * PGSIZE * 100 / zram.bytes : 0,
+            zram_stats.stores, zram_stats.loads, zram_stats.incompressible,
+            zram_stats.full);
+    zram_dump_hist("size", zram_stats.size_hist);
+    zram_dump_hist("compress", zram_stats.compress_hist);
+    zram_dump_hist("decompress", zram_stats.decompress_hist);
+    release(&zram.lock);
+}
+
+void zram_init(void) {
+    initlock(&zram.lock, "zram");
+    zram_refill();
+}
@@ -0,0 +1,48 @@
+/**
+ * Compressed swap in memory, the tier tried before the disk when swapping
+ * pages out (see swap.h). Pages are LZ4 compressed into blocks from
+ * kmalloc(), backed by a reserve of frames when memory runs out, and
+ * decompressed on fault, at a fraction of the cost of PIO
+ * disk transfers. Pages compressing poorly, or which would grow the pool past
+ * ZRAM_MAX_BYTES, are left to the disk.
+ */
+#ifndef ZRAM_H
+#define ZRAM_H
+
+#include <stdint.h>
+
+#include "paging.h"
+
+#define ZRAM_NSLOTS     2048
+/** Compressed pages larger than that aren't worth keeping in memory. */
+#define ZRAM_MAX_CSIZE  (PGSIZE * 3 / 4)
+/** Max compressed bytes held. */
+#define ZRAM_MAX_BYTES  (2 * 1024 * 1024)
+/** Frames set aside for compressed blocks, refilled after each reclaim. */
+#define ZRAM_RESERVE    4
+
+/** Histogram buckets: compressed sizes by 1/8th of a page, cycles by log2. */
+#define ZRAM_HIST       8
+#define ZRAM_HIST_CYCLES_SHIFT 13   // first latency bucket: below 8K cycles
+
+struct zram_stats {
+    uint32_t stores;            /** Pages compressed into the pool. */
+    uint32_t loads;             /** Pages decompressed back. */
+    uint32_t incompressible;    /** Pages over ZRAM_MAX_CSIZE. */
+    uint32_t full;              /** Pages turned down for lack of room. */
+    uint32_t size_hist[ZRAM_HIST];      /** Compressed size of stores. */
+    uint32_t compress_hist[ZRAM_HIST];  /** Compression cycles. */
+    uint32_t decompress_hist[ZRAM_HIST];/** Decompression cycles. */
+};
+
+extern struct zram_stats zram_stats;
+
+void zram_init(void);
+int32_t zram_store(const char *page);
+void zram_load(uint32_t idx, char *page);
+void zram_dup(uint32_t idx);
+void zram_put(uint32_t idx);
+void zram_refill(void);
+void zram_dump(void);
+
+#endif /* ZRAM_H */
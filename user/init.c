@@ -6,6 +6,31 @@ int main(int argc, char *argv[])
     char str[] = "Hello wolrd!";
     hello(num, str, str);
 
+    if (fork() == 0) {
+        // Copy-on-write: the child gets its own copy of the stack page here.
+        str[0] = 'h';
+        hello(num + 1, str, str);
+        exit(0);
+    }
+
+    // Read the disk in place: pages come straight from the page cache.
+    char *disk = mmap(0, 4096, PROT_READ, MAP_SHARED, 1, 0);
+    if (disk != MAP_FAILED) {
+        hello(0, disk, disk);
+        munmap(disk, 4096);
+    }
+
+    char *args[] = { "worker", "spawned", 0 };
+    spawn("worker", args);
+
+    // The kernel mustn't write exit statuses to read-only memory.
+    if (wait((int *)main) != -1)
+        hello(-1, str, "wait: read-only status address accepted");
+
+    // Free our children as they exit.
+    while (wait(0) >= 0)
+        ;
+
     exit(0);
     return 0;
 }
@@ -11,6 +11,16 @@ global %1
 
 SYSCALL hello
 SYSCALL exit
+SYSCALL yield
+SYSCALL fork
+SYSCALL spawn
+SYSCALL mmap
+SYSCALL munmap
+SYSCALL shmget
+SYSCALL shmat
+SYSCALL shmdt
+SYSCALL wait
+SYSCALL zpool
 
 ; For CFLAG += -fstack-protector without lib/debug.h
 global __stack_chk_guard
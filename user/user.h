@@ -1,7 +1,23 @@
 #ifndef USER_H
 #define USER_H
 
+#include "kernel/mman.h"
+
 int hello(int len, char *ptr, char *str);
 void exit(int status);
+void yield(void);
+int fork(void);
+int spawn(const char *path, char **argv);
+/** dev is a block device number rather than a file descriptor. */
+void *mmap(void *addr, unsigned int len, int prot, int flags, int dev,
+           unsigned int off);
+int munmap(void *addr, unsigned int len);
+int shmget(int key, unsigned int size);
+void *shmat(int id, void *addr);
+int shmdt(void *addr);
+int wait(int *status);
+/** Set the number of zeroed frames prepared while idle, at most 1024
+    (ZPOOL_HIGH_MAX). Returns the previous number. */
+int zpool(int high);
 
 #endif /* USER_H */
@@ -0,0 +1,11 @@
+#include "user/user.h"
+
+/** Short-lived worker, started by init with spawn(). */
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+        hello(i, argv[i], argv[i]);
+
+    exit(0);
+    return 0;
+}